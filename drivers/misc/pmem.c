@@ -30,6 +30,9 @@
 #define PMEM_MAX_DEVICES 10
 #define PMEM_MAX_ORDER 128
 #define PMEM_MIN_ALLOC PAGE_SIZE
+/* number of free lists, a region can't have more than 2^BITS_PER_LONG
+ * entries */
+#define PMEM_FREE_ORDERS BITS_PER_LONG
 
 #define PMEM_DEBUG 1
 
@@ -84,6 +87,13 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* links a free slot into the free list of its order, only valid for the
+ * first entry of a free slot */
+struct pmem_free_link {
+	int next;
+	int prev;
+};
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -116,6 +126,12 @@ struct pmem_info {
 	/* the bitmap for the region indicating which entries are allocated
 	 * and which are free */
 	struct pmem_bits *bitmap;
+	/* free slots of each order are kept on a doubly linked list threaded
+	 * through free_link, so allocating and freeing don't have to walk
+	 * the bitmap */
+	struct pmem_free_link *free_link;
+	int free_head[PMEM_FREE_ORDERS];
+	unsigned long free_count[PMEM_FREE_ORDERS];
 	/* indicates the region should not be managed with an allocator */
 	unsigned no_allocator;
 	/* indicates maps of this region should be cached, if a mix of
@@ -232,6 +248,34 @@ static int is_master_owner(struct file *file)
 	return ret;
 }
 
+static void pmem_free_list_add(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int head = pmem[id].free_head[order];
+
+	pmem[id].free_link[index].prev = -1;
+	pmem[id].free_link[index].next = head;
+	if (head >= 0)
+		pmem[id].free_link[head].prev = index;
+	pmem[id].free_head[order] = index;
+	pmem[id].free_count[order]++;
+}
+
+static void pmem_free_list_del(int id, int index)
+{
+	int order = PMEM_ORDER(id, index);
+	int next = pmem[id].free_link[index].next;
+	int prev = pmem[id].free_link[index].prev;
+
+	if (prev >= 0)
+		pmem[id].free_link[prev].next = next;
+	else
+		pmem[id].free_head[order] = next;
+	if (next >= 0)
+		pmem[id].free_link[next].prev = prev;
+	pmem[id].free_count[order]--;
+}
+
 static int pmem_free(int id, int index)
 {
 	/* caller should hold the write lock on pmem_sem! */
@@ -248,17 +292,17 @@ static int pmem_free(int id, int index)
 	 * if the buddy is also free merge them
 	 * repeat until the buddy is not free or end of the bitmap is reached
 	 */
-	do {
+	for (;;) {
 		buddy = PMEM_BUDDY_INDEX(id, curr);
-		if (PMEM_IS_FREE(id, buddy) &&
-				PMEM_ORDER(id, buddy) == PMEM_ORDER(id, curr)) {
-			PMEM_ORDER(id, buddy)++;
-			PMEM_ORDER(id, curr)++;
-			curr = min(buddy, curr);
-		} else {
+		if (buddy >= pmem[id].num_entries || !PMEM_IS_FREE(id, buddy) ||
+		    PMEM_ORDER(id, buddy) != PMEM_ORDER(id, curr))
 			break;
-		}
-	} while (curr < pmem[id].num_entries);
+		pmem_free_list_del(id, buddy);
+		PMEM_ORDER(id, buddy)++;
+		PMEM_ORDER(id, curr)++;
+		curr = min(buddy, curr);
+	}
+	pmem_free_list_add(id, curr);
 
 	return 0;
 }
@@ -380,10 +424,9 @@ static int pmem_allocate(int id, unsigned long len)
 {
 	/* caller should hold the write lock on pmem_sem! */
 	/* return the corresponding pdata[] entry */
-	int curr = 0;
-	int end = pmem[id].num_entries;
 	int best_fit = -1;
 	unsigned long order = pmem_order(len);
+	unsigned long curr;
 
 	if (pmem[id].no_allocator) {
 		DLOG("no allocator");
@@ -397,23 +440,14 @@ static int pmem_allocate(int id, unsigned long len)
 		return -1;
 	DLOG("order %lx\n", order);
 
-	/* look through the bitmap:
-	 * 	if you find a free slot of the correct order use it
-	 * 	otherwise, use the best fit (smallest with size > order) slot
+	/* take the first slot off the free list of the correct order,
+	 * otherwise off the smallest non empty list with order > order
 	 */
-	while (curr < end) {
-		if (PMEM_IS_FREE(id, curr)) {
-			if (PMEM_ORDER(id, curr) == (unsigned char)order) {
-				/* set the not free bit and clear others */
-				best_fit = curr;
-				break;
-			}
-			if (PMEM_ORDER(id, curr) > (unsigned char)order &&
-			    (best_fit < 0 ||
-			     PMEM_ORDER(id, curr) < PMEM_ORDER(id, best_fit)))
-				best_fit = curr;
+	for (curr = order; curr < PMEM_FREE_ORDERS; curr++) {
+		if (pmem[id].free_head[curr] >= 0) {
+			best_fit = pmem[id].free_head[curr];
+			break;
 		}
-		curr = PMEM_NEXT_INDEX(id, curr);
 	}
 
 	/* if best_fit < 0, there are no suitable slots,
@@ -427,12 +461,16 @@ static int pmem_allocate(int id, unsigned long len)
 	/* now partition the best fit:
 	 * 	split the slot into 2 buddies of order - 1
 	 * 	repeat until the slot is of the correct order
+	 * 	the upper buddies go back on the free lists
 	 */
+	pmem_free_list_del(id, best_fit);
 	while (PMEM_ORDER(id, best_fit) > (unsigned char)order) {
 		int buddy;
 		PMEM_ORDER(id, best_fit) -= 1;
 		buddy = PMEM_BUDDY_INDEX(id, best_fit);
 		PMEM_ORDER(id, buddy) = PMEM_ORDER(id, best_fit);
+		pmem[id].bitmap[buddy].allocated = 0;
+		pmem_free_list_add(id, buddy);
 	}
 	pmem[id].bitmap[best_fit].allocated = 1;
 	return best_fit;
@@ -1175,8 +1213,33 @@ static ssize_t debug_read(struct file *file, char __user *buf, size_t count,
 	int n = 0;
 
 	DLOG("debug open\n");
-	n = scnprintf(buffer, debug_bufmax,
-		      "pid #: mapped regions (offset, len) (offset,len)...\n");
+	if (!pmem[id].no_allocator) {
+		unsigned long free = 0;
+		int order, largest = -1;
+
+		down_read(&pmem[id].bitmap_sem);
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "free slots per order:");
+		for (order = 0; order < PMEM_FREE_ORDERS; order++) {
+			if (!pmem[id].free_count[order])
+				continue;
+			free += pmem[id].free_count[order] << order;
+			largest = order;
+			n += scnprintf(buffer + n, debug_bufmax - n, " %d:%lu",
+				       order, pmem[id].free_count[order]);
+		}
+		up_read(&pmem[id].bitmap_sem);
+		/* fragmentation is the share of the free space that is not
+		 * in the largest free slot */
+		n += scnprintf(buffer + n, debug_bufmax - n,
+			       "\nfree %lu of %lu pages, largest free slot %lu "
+			       "pages, fragmentation %lu%%\n", free,
+			       pmem[id].num_entries,
+			       largest < 0 ? 0 : 1UL << largest,
+			       free ? 100 - (100UL << largest) / free : 0);
+	}
+	n += scnprintf(buffer + n, debug_bufmax - n,
+		       "pid #: mapped regions (offset, len) (offset,len)...\n");
 
 	down(&pmem[id].data_list_sem);
 	list_for_each(elt, &pmem[id].data_list) {
@@ -1254,9 +1317,19 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	memset(pmem[id].bitmap, 0, sizeof(struct pmem_bits) *
 					  pmem[id].num_entries);
 
+	pmem[id].free_link = kmalloc(pmem[id].num_entries *
+				     sizeof(struct pmem_free_link), GFP_KERNEL);
+	if (!pmem[id].free_link)
+		goto err_no_mem_for_free_lists;
+	for (i = 0; i < PMEM_FREE_ORDERS; i++) {
+		pmem[id].free_head[i] = -1;
+		pmem[id].free_count[i] = 0;
+	}
+
 	for (i = sizeof(pmem[id].num_entries) * 8 - 1; i >= 0; i--) {
 		if ((pmem[id].num_entries) &  1<<i) {
 			PMEM_ORDER(id, index) = i;
+			pmem_free_list_add(id, index);
 			index = PMEM_NEXT_INDEX(id, index);
 		}
 	}
@@ -1285,6 +1358,8 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 #endif
 	return 0;
 error_cant_remap:
+	kfree(pmem[id].free_link);
+err_no_mem_for_free_lists:
 	kfree(pmem[id].bitmap);
 err_no_mem_for_metadata:
 	misc_deregister(&pmem[id].dev);
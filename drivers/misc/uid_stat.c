@@ -13,56 +13,83 @@
  *
  */
 
-#include <asm/atomic.h>
-
 #include <linux/err.h>
+#include <linux/hash.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/stat.h>
 #include <linux/uid_stat.h>
 
+#define UID_HASH_BITS	6
+#define UID_HASH_SIZE	(1 << UID_HASH_BITS)
+
+/* uid_lock only serializes additions, lookups walk the hash under RCU. */
 static DEFINE_SPINLOCK(uid_lock);
-static LIST_HEAD(uid_list);
+static struct hlist_head uid_hash[UID_HASH_SIZE];
 static struct proc_dir_entry *parent;
 
+/* Byte counters, wrapping at 4GB like the /proc interface always did. */
+struct uid_stat_counters {
+	unsigned int tcp_rcv;
+	unsigned int tcp_snd;
+};
+
 struct uid_stat {
-	struct list_head link;
+	struct hlist_node link;
 	uid_t uid;
-	atomic_t tcp_rcv;
-	atomic_t tcp_snd;
+	struct uid_stat_counters *counters;	/* per-cpu */
 };
 
+static struct hlist_head *uid_hash_head(uid_t uid)
+{
+	return &uid_hash[hash_long(uid, UID_HASH_BITS)];
+}
+
+/* Must be called with rcu_read_lock or uid_lock held. */
 static struct uid_stat *find_uid_stat(uid_t uid) {
-	unsigned long flags;
 	struct uid_stat *entry;
+	struct hlist_node *pos;
 
-	spin_lock_irqsave(&uid_lock, flags);
-	list_for_each_entry(entry, &uid_list, link) {
-		if (entry->uid == uid) {
-			spin_unlock_irqrestore(&uid_lock, flags);
+	hlist_for_each_entry_rcu(entry, pos, uid_hash_head(uid), link) {
+		if (entry->uid == uid)
 			return entry;
-		}
 	}
-	spin_unlock_irqrestore(&uid_lock, flags);
 	return NULL;
 }
 
+/* Fold the per-cpu counters of an entry. */
+static void uid_stat_sum(struct uid_stat *entry, struct uid_stat_counters *sum)
+{
+	int cpu;
+
+	sum->tcp_rcv = 0;
+	sum->tcp_snd = 0;
+	for_each_possible_cpu(cpu) {
+		struct uid_stat_counters *c = per_cpu_ptr(entry->counters, cpu);
+		sum->tcp_rcv += c->tcp_rcv;
+		sum->tcp_snd += c->tcp_snd;
+	}
+}
+
 static int tcp_snd_read_proc(char *page, char **start, off_t off,
 				int count, int *eof, void *data)
 {
 	int len;
-	unsigned int bytes;
+	struct uid_stat_counters sum;
 	char *p = page;
 	struct uid_stat *uid_entry = (struct uid_stat *) data;
 	if (!data)
 		return 0;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_snd) + INT_MIN);
-	p += sprintf(p, "%u\n", bytes);
+	uid_stat_sum(uid_entry, &sum);
+	p += sprintf(p, "%u\n", sum.tcp_snd);
 	len = (p - page) - off;
 	*eof = (len <= count) ? 1 : 0;
 	*start = page + off;
@@ -73,14 +100,14 @@ static int tcp_rcv_read_proc(char *page, char **start, off_t off,
 				int count, int *eof, void *data)
 {
 	int len;
-	unsigned int bytes;
+	struct uid_stat_counters sum;
 	char *p = page;
 	struct uid_stat *uid_entry = (struct uid_stat *) data;
 	if (!data)
 		return 0;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_rcv) + INT_MIN);
-	p += sprintf(p, "%u\n", bytes);
+	uid_stat_sum(uid_entry, &sum);
+	p += sprintf(p, "%u\n", sum.tcp_rcv);
 	len = (p - page) - off;
 	*eof = (len <= count) ? 1 : 0;
 	*start = page + off;
@@ -91,20 +118,31 @@ static int tcp_rcv_read_proc(char *page, char **start, off_t off,
 static struct uid_stat *create_stat(uid_t uid) {
 	unsigned long flags;
 	char uid_s[32];
-	struct uid_stat *new_uid;
+	struct uid_stat *new_uid, *old_uid;
 	struct proc_dir_entry *entry;
 
-	/* Create the uid stat struct and append it to the list. */
+	/* Create the uid stat struct and add it to the hash. */
 	if ((new_uid = kmalloc(sizeof(struct uid_stat), GFP_KERNEL)) == NULL)
 		return NULL;
 
 	new_uid->uid = uid;
-	/* Counters start at INT_MIN, so we can track 4GB of network traffic. */
-	atomic_set(&new_uid->tcp_rcv, INT_MIN);
-	atomic_set(&new_uid->tcp_snd, INT_MIN);
+	/* alloc_percpu() returns zeroed counters. */
+	new_uid->counters = alloc_percpu(struct uid_stat_counters);
+	if (!new_uid->counters) {
+		kfree(new_uid);
+		return NULL;
+	}
 
 	spin_lock_irqsave(&uid_lock, flags);
-	list_add_tail(&new_uid->link, &uid_list);
+	/* Someone else may have added this uid meanwhile. */
+	old_uid = find_uid_stat(uid);
+	if (old_uid) {
+		spin_unlock_irqrestore(&uid_lock, flags);
+		free_percpu(new_uid->counters);
+		kfree(new_uid);
+		return old_uid;
+	}
+	hlist_add_head_rcu(&new_uid->link, uid_hash_head(uid));
 	spin_unlock_irqrestore(&uid_lock, flags);
 
 	sprintf(uid_s, "%d", uid);
@@ -120,26 +158,72 @@ static struct uid_stat *create_stat(uid_t uid) {
 	return new_uid;
 }
 
+/* Entries are never freed, so the pointer stays valid after the lookup. */
+static struct uid_stat *get_uid_stat(uid_t uid) {
+	struct uid_stat *entry;
+
+	rcu_read_lock();
+	entry = find_uid_stat(uid);
+	rcu_read_unlock();
+
+	if (entry == NULL)
+		entry = create_stat(uid);
+	return entry;
+}
+
 int update_tcp_snd(uid_t uid, int size) {
 	struct uid_stat *entry;
-	if ((entry = find_uid_stat(uid)) == NULL &&
-		((entry = create_stat(uid)) == NULL)) {
-			return -1;
-	}
-	atomic_add(size, &entry->tcp_snd);
+	if ((entry = get_uid_stat(uid)) == NULL)
+		return -1;
+	per_cpu_ptr(entry->counters, get_cpu())->tcp_snd += size;
+	put_cpu();
 	return 0;
 }
 
 int update_tcp_rcv(uid_t uid, int size) {
 	struct uid_stat *entry;
-	if ((entry = find_uid_stat(uid)) == NULL &&
-		((entry = create_stat(uid)) == NULL)) {
-			return -1;
+	if ((entry = get_uid_stat(uid)) == NULL)
+		return -1;
+	per_cpu_ptr(entry->counters, get_cpu())->tcp_rcv += size;
+	put_cpu();
+	return 0;
+}
+
+/*
+ * /proc/uid_stat/all: one "uid tcp_snd tcp_rcv" line per uid, so that
+ * all uids can be read at once.
+ */
+static int uid_stat_all_show(struct seq_file *m, void *v)
+{
+	int i;
+	struct uid_stat *entry;
+	struct hlist_node *pos;
+	struct uid_stat_counters sum;
+
+	rcu_read_lock();
+	for (i = 0; i < UID_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(entry, pos, &uid_hash[i], link) {
+			uid_stat_sum(entry, &sum);
+			seq_printf(m, "%u %u %u\n", entry->uid,
+				   sum.tcp_snd, sum.tcp_rcv);
+		}
 	}
-	atomic_add(size, &entry->tcp_rcv);
+	rcu_read_unlock();
 	return 0;
 }
 
+static int uid_stat_all_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, uid_stat_all_show, NULL);
+}
+
+static const struct file_operations uid_stat_all_fops = {
+	.open		= uid_stat_all_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static int __init uid_stat_init(void)
 {
 	parent = proc_mkdir("uid_stat", NULL);
@@ -147,6 +231,7 @@ static int __init uid_stat_init(void)
 		pr_err("uid_stat: failed to create proc entry\n");
 		return -1;
 	}
+	proc_create("all", S_IRUGO, parent, &uid_stat_all_fops);
 	return 0;
 }
 
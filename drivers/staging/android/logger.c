@@ -23,38 +23,72 @@
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/timer.h>
+#include <linux/mm.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
+#include <asm/io.h>
+
+/*
+ * Readers are woken up once 'wakeup_bytes' bytes have been logged since the
+ * last wakeup, or 'wakeup_latency_ms' after the first entry that did not
+ * wake them, whichever comes first. Setting either to zero wakes readers on
+ * every entry.
+ */
+static unsigned int logger_wakeup_bytes = 2048;
+module_param_named(wakeup_bytes, logger_wakeup_bytes, uint,
+		   S_IRUGO | S_IWUSR);
+static unsigned int logger_wakeup_latency_ms = 10;
+module_param_named(wakeup_latency_ms, logger_wakeup_latency_ms, uint,
+		   S_IRUGO | S_IWUSR);
 
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock', which is only ever held while copying a single entry in
+ * or out of the buffer.
  */
 struct logger_log {
 	unsigned char *		buffer;	/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	atomic_t		wake_pending; /* bytes logged since last wakeup */
+	struct timer_list	wake_timer; /* deferred reader wakeup */
+	int			nr_mapped; /* readers with a mapped header */
 };
 
+/*
+ * struct logger_staging - per-cpu buffer a writer assembles its entry in
+ *
+ * The payload is copied from user-space into it before log->lock is taken,
+ * so the time spent under the lock does not depend on user-space memory.
+ */
+struct logger_staging {
+	unsigned char		buf[LOGGER_ENTRY_MAX_LEN];
+};
+
+static DEFINE_PER_CPU(struct logger_staging, logger_staging);
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log *	log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	struct logger_mmap_header *header; /* mmap()ed state, or NULL */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -87,7 +121,7 @@ static inline struct logger_log * file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -105,11 +139,44 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * update_header - publishes the state of 'log' to the mmap header of 'reader'
+ *
+ * Caller needs to hold log->lock.
+ */
+static void update_header(struct logger_log *log, struct logger_reader *reader)
+{
+	struct logger_mmap_header *header = reader->header;
+
+	header->w_off = log->w_off;
+	header->head = log->head;
+	header->r_off = reader->r_off;
+}
+
+/*
+ * update_headers - publishes the state of 'log' to every reader that mapped
+ * it
+ *
+ * Caller needs to hold log->lock.
+ */
+static void update_headers(struct logger_log *log)
+{
+	struct logger_reader *reader;
+
+	if (!log->nr_mapped)
+		return;
+
+	list_for_each_entry(reader, &log->readers, list)
+		if (reader->header)
+			update_header(log, reader);
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
  * user-space buffer 'buf'. Returns 'count' on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock and have page faults disabled; -EFAULT is
+ * returned without consuming the entry if 'buf' is not resident.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
@@ -124,7 +191,7 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	if (__copy_to_user_inatomic(buf, log->buffer + reader->r_off, len))
 		return -EFAULT;
 
 	/*
@@ -132,10 +199,13 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log.
 	 */
 	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
+		if (__copy_to_user_inatomic(buf + len, log->buffer,
+					    count - len))
 			return -EFAULT;
 
 	reader->r_off = logger_offset(reader->r_off + count);
+	if (reader->header)
+		reader->header->r_off = reader->r_off;
 
 	return count;
 }
@@ -158,15 +228,19 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t len;
 	DEFINE_WAIT(wait);
 
+	if (!access_ok(VERIFY_WRITE, buf, count))
+		return -EFAULT;
+
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -187,26 +261,39 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
+	len = get_entry_len(log, reader->r_off);
+	if (count < len) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	pagefault_disable();
+	ret = do_read_log_to_user(log, reader, buf, len);
+	pagefault_enable();
 
 out:
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	/*
+	 * We cannot fault with log->lock held; fault the buffer in and try
+	 * again. The entry may have been overwritten in the meantime, so
+	 * start over from the wait.
+	 */
+	if (ret == -EFAULT) {
+		if (clear_user(buf, len))
+			return -EFAULT;
+		goto start;
+	}
 
 	return ret;
 }
@@ -215,7 +302,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -253,7 +340,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -272,7 +359,7 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -289,94 +376,160 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
+ * copy_iov_from_user - copies the first 'count' bytes described by 'iov' into
+ * the kernel buffer 'buf'. If 'atomic' is set the copy does not fault pages
+ * in, and fails instead.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns zero on success, -EFAULT on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
+static int copy_iov_from_user(unsigned char *buf, const struct iovec *iov,
+			      unsigned long nr_segs, size_t count, int atomic)
 {
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	while (nr_segs-- > 0 && count) {
+		size_t len;
+		unsigned long left;
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
+		/* figure out how much of this vector we can keep */
+		len = min_t(size_t, iov->iov_len, count);
+
+		if (atomic) {
+			if (!access_ok(VERIFY_READ, iov->iov_base, len))
+				return -EFAULT;
+			pagefault_disable();
+			left = __copy_from_user_inatomic(buf, iov->iov_base,
+							 len);
+			pagefault_enable();
+		} else
+			left = copy_from_user(buf, iov->iov_base, len);
+		if (left)
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
+		iov++;
+		buf += len;
+		count -= len;
+	}
 
-	return count;
+	return 0;
+}
+
+/*
+ * logger_wake_timer - fires 'wakeup_latency_ms' after an entry that did not
+ * wake up the readers itself
+ */
+static void logger_wake_timer(unsigned long data)
+{
+	struct logger_log *log = (struct logger_log *) data;
+
+	atomic_set(&log->wake_pending, 0);
+	wake_up_interruptible(&log->wq);
+}
+
+/*
+ * wake_up_readers - tell the readers that 'count' more bytes were logged,
+ * waking them up now or arming the wakeup timer.
+ */
+static void wake_up_readers(struct logger_log *log, size_t count)
+{
+	unsigned int bytes = logger_wakeup_bytes;
+	unsigned int latency = logger_wakeup_latency_ms;
+
+	if (!bytes || !latency ||
+	    atomic_add_return(count, &log->wake_pending) >= bytes) {
+		atomic_set(&log->wake_pending, 0);
+		if (timer_pending(&log->wake_timer))
+			del_timer(&log->wake_timer);
+		wake_up_interruptible(&log->wq);
+	} else if (!timer_pending(&log->wake_timer))
+		mod_timer(&log->wake_timer,
+			  jiffies + msecs_to_jiffies(latency));
 }
 
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
  * them above all else.
+ *
+ * The entry is assembled in this cpu's staging buffer first, so log->lock is
+ * only held for the memcpy() into the ring. Should the payload not be
+ * resident, it is faulted in through a temporary buffer instead.
  */
 ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
-	struct logger_entry header;
+	struct logger_entry *header;
 	struct timespec now;
-	ssize_t ret = 0;
-
-	now = current_kernel_time();
+	unsigned char *buf;
+	size_t len, count;
+	int staged = 1;
+	int ret;
 
-	header.pid = current->tgid;
-	header.tid = current->pid;
-	header.sec = now.tv_sec;
-	header.nsec = now.tv_nsec;
-	header.len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
+	len = min_t(size_t, iocb->ki_left, LOGGER_ENTRY_MAX_PAYLOAD);
 
 	/* null writes succeed, return zero */
-	if (unlikely(!header.len))
+	if (unlikely(!len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	count = sizeof(struct logger_entry) + len;
+
+	buf = get_cpu_var(logger_staging).buf;
+	ret = copy_iov_from_user(buf + sizeof(struct logger_entry), iov,
+				 nr_segs, len, 1);
+	if (unlikely(ret)) {
+		put_cpu_var(logger_staging);
+		staged = 0;
+
+		buf = kmalloc(count, GFP_KERNEL);
+		if (!buf)
+			return -ENOMEM;
+		ret = copy_iov_from_user(buf + sizeof(struct logger_entry),
+					 iov, nr_segs, len, 0);
+		if (ret) {
+			kfree(buf);
+			return ret;
+		}
+	}
+
+	now = current_kernel_time();
+
+	header = (struct logger_entry *) buf;
+	header->len = len;
+	header->__pad = 0;
+	header->pid = current->tgid;
+	header->tid = current->pid;
+	header->sec = now.tv_sec;
+	header->nsec = now.tv_nsec;
+
+	spin_lock(&log->lock);
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * entry after (what will be) the new write offset.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	fix_up_readers(log, count);
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
-
-	while (nr_segs-- > 0) {
-		size_t len;
-		ssize_t nr;
-
-		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
-
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
-		}
+	/*
+	 * Readers parsing the buffer in place must see the new head before
+	 * the old entries are overwritten, and the entry before the new
+	 * write offset.
+	 */
+	update_headers(log);
+	smp_wmb();
+	do_write_log(log, buf, count);
+	smp_wmb();
+	update_headers(log);
 
-		iov++;
-		ret += nr;
-	}
+	spin_unlock(&log->lock);
 
-	mutex_unlock(&log->mutex);
+	if (likely(staged))
+		put_cpu_var(logger_staging);
+	else
+		kfree(buf);
 
 	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	wake_up_readers(log, count);
 
-	return ret;
+	return len;
 }
 
 static struct logger_log * get_log_from_minor(int);
@@ -407,12 +560,13 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->header = NULL;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -430,7 +584,15 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		if (reader->header)
+			log->nr_mapped--;
+		spin_unlock(&log->lock);
+		if (reader->header)
+			free_page((unsigned long) reader->header);
 		kfree(reader);
 	}
 
@@ -460,21 +622,126 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
 
+/*
+ * The log buffers are static arrays: in the kernel image they are in the
+ * linear map, but a modular build puts them in module space, which is only
+ * virtually contiguous. Look them up a page at a time.
+ */
+static unsigned long logger_buffer_pfn(unsigned char *addr)
+{
+#ifdef MODULE
+	return vmalloc_to_pfn(addr);
+#else
+	return virt_to_phys(addr) >> PAGE_SHIFT;
+#endif
+}
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps a header page private to this reader, followed by the log buffer
+ * itself, both read-only. The reader parses entries in place and advances
+ * its position with LOGGER_SET_READ_OFF, which keeps poll() working.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_reader *reader;
+	struct logger_log *log;
+	struct logger_mmap_header *header;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	size_t off;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+
+	reader = file->private_data;
+	log = reader->log;
+
+	if (vma->vm_pgoff || size != PAGE_SIZE + log->size)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	header = (struct logger_mmap_header *) get_zeroed_page(GFP_KERNEL);
+	if (!header)
+		return -ENOMEM;
+
+	spin_lock(&log->lock);
+	if (!reader->header) {
+		reader->header = header;
+		header->size = log->size;
+		update_header(log, reader);
+		log->nr_mapped++;
+		header = NULL;
+	}
+	spin_unlock(&log->lock);
+
+	/* mapped before by another mmap() of this reader */
+	if (header)
+		free_page((unsigned long) header);
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+			      virt_to_phys(reader->header) >> PAGE_SHIFT,
+			      PAGE_SIZE, vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	for (off = 0; off < log->size; off += PAGE_SIZE) {
+		ret = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE + off,
+				      logger_buffer_pfn(log->buffer + off),
+				      PAGE_SIZE, vma->vm_page_prot);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * set_read_off - moves 'reader' forward to 'off', which must be the start of
+ * an entry between the reader's current position and the write head.
+ *
+ * The caller needs to hold log->lock.
+ */
+static long set_read_off(struct logger_log *log, struct logger_reader *reader,
+			 size_t off)
+{
+	size_t r_off = reader->r_off;
+
+	if (off >= log->size)
+		return -EINVAL;
+
+	while (r_off != off) {
+		/* not an entry boundary, or the reader was lapped */
+		if (r_off == log->w_off)
+			return -EINVAL;
+		r_off = logger_offset(r_off + get_entry_len(log, r_off));
+	}
+
+	reader->r_off = r_off;
+	if (reader->header)
+		reader->header->r_off = r_off;
+
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -510,11 +777,20 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+		update_headers(log);
 		ret = 0;
 		break;
+	case LOGGER_SET_READ_OFF:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		ret = set_read_off(log, reader, arg);
+		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -524,6 +800,7 @@ static struct file_operations logger_fops = {
 	.read = logger_read,
 	.aio_write = logger_aio_write,
 	.poll = logger_poll,
+	.mmap = logger_mmap,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
 	.open = logger_open,
@@ -533,10 +810,11 @@ static struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is page aligned so readers
+ * can mmap() it.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
+static unsigned char _buf_ ## VAR[SIZE] __aligned(PAGE_SIZE); \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
 	.misc = { \
@@ -547,10 +825,14 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.wake_pending = ATOMIC_INIT(0), \
+	.nr_mapped = 0, \
+	.wake_timer = TIMER_INITIALIZER(logger_wake_timer, 0, \
+				       (unsigned long) &VAR), \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -30,6 +30,19 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/*
+ * struct logger_mmap_header - first page of a reader's read-only mmap() of a
+ * log. The log buffer itself follows at the next page boundary. The kernel
+ * updates 'head' before it overwrites any entry, so an entry parsed in place
+ * is valid if it still lies between 'head' and 'w_off' afterwards.
+ */
+struct logger_mmap_header {
+	__u32		size;	/* size of the log buffer */
+	__u32		w_off;	/* the next entry is written here */
+	__u32		head;	/* oldest entry still in the log */
+	__u32		r_off;	/* this reader's position */
+};
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -45,5 +58,6 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_READ_OFF		_IO(__LOGGERIO, 5) /* advance reader */
 
 #endif /* _LINUX_LOGGER_H */
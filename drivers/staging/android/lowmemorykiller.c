@@ -16,6 +16,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * To avoid walking every process on each shrinker call, the processes are
+ * kept in an index bucketed by oom_adj, kept up to date from the fork, exit
+ * and oom_adj notifications, so a call just looks at the processes in the
+ * highest populated bucket. The counters in the stat_* parameters show how
+ * often the index is scanned and rebuilt, how many processes were killed
+ * and how much time was spent selecting them.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +42,13 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/workqueue.h>
 
 ////<<<<<<< HEAD
 ////static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask);
@@ -63,6 +77,43 @@ static size_t lowmem_minfree[6] = {
 static int lowmem_minfree_size = 4;
 
 static struct task_struct *lowmem_deathpending;
+static unsigned long lowmem_deathpending_timeout;
+static uint32_t lowmem_deathpending_timeout_ms = 1000;
+
+static uint32_t lowmem_stat_scans;
+static uint32_t lowmem_stat_rebuilds;
+static uint32_t lowmem_stat_kills;
+static uint32_t lowmem_stat_ratelimited;
+static uint32_t lowmem_stat_scan_us;
+
+/*
+ * The processes are kept in lists by oom_adj, and hashed by tgid so that the
+ * fork, exit and oom_adj notifications can find them. If an entry cannot be
+ * allocated, the index is dropped and rebuilt from the task list by a work.
+ */
+#define LOWMEM_BUCKETS		(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+struct lowmem_entry {
+	struct hlist_node hash;
+	struct list_head list;
+	pid_t tgid;
+};
+
+struct lowmem_victim {
+	struct task_struct *task;
+	int tasksize;
+	int oom_adj;
+};
+
+static DEFINE_MUTEX(lowmem_lock);
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct hlist_head lowmem_hash[1 << LOWMEM_HASH_BITS];
+static struct list_head lowmem_bucket[LOWMEM_BUCKETS];
+static int lowmem_index_ready;
+
+static void lowmem_rebuild_index(struct work_struct *work);
+static DECLARE_WORK(lowmem_rebuild_work, lowmem_rebuild_index);
 
 #define lowmem_print(level, x...)			\
 	do {						\
@@ -88,16 +139,211 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+/* The functions below are called with lowmem_index_lock held. */
+
+static struct lowmem_entry *lowmem_index_find(pid_t tgid)
+{
+	struct lowmem_entry *e;
+	struct hlist_node *n;
+
+	hlist_for_each_entry(e, n, &lowmem_hash[hash_long(tgid,
+				LOWMEM_HASH_BITS)], hash)
+		if (e->tgid == tgid)
+			return e;
+	return NULL;
+}
+
+static void lowmem_index_clear(void)
+{
+	struct lowmem_entry *e;
+	struct hlist_node *n, *tmp;
+	int i;
+
+	for (i = 0; i < (1 << LOWMEM_HASH_BITS); i++)
+		hlist_for_each_entry_safe(e, n, tmp, &lowmem_hash[i], hash)
+			kfree(e);
+	for (i = 0; i < (1 << LOWMEM_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&lowmem_hash[i]);
+	for (i = 0; i < LOWMEM_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_bucket[i]);
+	lowmem_index_ready = 0;
+}
+
+/* file the thread group of p under its current oom_adj */
+static int lowmem_index_set(struct task_struct *p)
+{
+	struct lowmem_entry *e = lowmem_index_find(p->tgid);
+	int bucket = p->signal->oom_adj - OOM_DISABLE;
+
+	if (bucket < 0 || bucket >= LOWMEM_BUCKETS)
+		bucket = 0;
+	if (!e) {
+		e = kmalloc(sizeof(*e), GFP_ATOMIC);
+		if (!e)
+			return -ENOMEM;
+		e->tgid = p->tgid;
+		hlist_add_head(&e->hash, &lowmem_hash[hash_long(p->tgid,
+				LOWMEM_HASH_BITS)]);
+		INIT_LIST_HEAD(&e->list);
+	}
+	list_move(&e->list, &lowmem_bucket[bucket]);
+	return 0;
+}
+
+static void lowmem_index_del(struct task_struct *p)
+{
+	struct lowmem_entry *e = lowmem_index_find(p->tgid);
+
+	if (e) {
+		hlist_del(&e->hash);
+		list_del(&e->list);
+		kfree(e);
+	}
+}
+
+/*
+ * A task without an mm yet (forked from a kernel thread, before its exec)
+ * is indexed all the same; lowmem_consider looks at the mm when a victim
+ * is picked.
+ */
+static int lowmem_indexable(struct task_struct *p)
+{
+	return !(p->flags & PF_KTHREAD) && atomic_read(&p->signal->live);
+}
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	int ret = 0;
+
+	spin_lock(&lowmem_index_lock);
+	/* while the index is rebuilt, the task list is authoritative */
+	if (lowmem_index_ready) {
+		if (val == OOM_ADJ_EXIT)
+			lowmem_index_del(task);
+		else if (lowmem_indexable(task))
+			ret = lowmem_index_set(task);
+		if (ret) {
+			lowmem_index_clear();
+			schedule_work(&lowmem_rebuild_work);
+		}
+	}
+	spin_unlock(&lowmem_index_lock);
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * Rebuild the oom_adj index from the task list. Notifications that come in
+ * before the locks are taken are already visible in the task list; the
+ * ones that come in later are applied to the new index.
+ */
+static void lowmem_rebuild_index(struct work_struct *work)
 {
 	struct task_struct *p;
-	struct task_struct *selected = NULL;
-	int rem = 0;
+	int ret = 0;
+
+	read_lock(&tasklist_lock);
+	spin_lock(&lowmem_index_lock);
+	lowmem_index_clear();
+	for_each_process(p) {
+		if (p->signal && lowmem_indexable(p))
+			ret = lowmem_index_set(p);
+		if (ret)
+			break;
+	}
+	if (ret)
+		lowmem_index_clear();
+	else {
+		lowmem_index_ready = 1;
+		lowmem_stat_rebuilds++;
+	}
+	spin_unlock(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+}
+
+/*
+ * Consider p as a victim, preferring the highest oom_adj and then the
+ * largest rss. Called with tasklist_lock held.
+ */
+static void lowmem_consider(struct lowmem_victim *victim,
+			    struct task_struct *p, int min_adj)
+{
+	struct mm_struct *mm;
+	struct signal_struct *sig;
+	int oom_adj;
 	int tasksize;
+
+	task_lock(p);
+	mm = p->mm;
+	sig = p->signal;
+	if (!mm || !sig) {
+		task_unlock(p);
+		return;
+	}
+	oom_adj = sig->oom_adj;
+	if (oom_adj < min_adj) {
+		task_unlock(p);
+		return;
+	}
+	tasksize = get_mm_rss(mm);
+	task_unlock(p);
+	if (tasksize <= 0)
+		return;
+	if (victim->task) {
+		if (oom_adj < victim->oom_adj)
+			return;
+		if (oom_adj == victim->oom_adj &&
+		    tasksize <= victim->tasksize)
+			return;
+	}
+	victim->task = p;
+	victim->tasksize = tasksize;
+	victim->oom_adj = oom_adj;
+	lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+		     p->pid, p->comm, oom_adj, tasksize);
+}
+
+/*
+ * Only the highest bucket that holds a live process needs to be looked at.
+ * Called with tasklist_lock and lowmem_index_lock held.
+ */
+static void lowmem_select_indexed(struct lowmem_victim *victim, int min_adj)
+{
+	int bucket = LOWMEM_BUCKETS - 1;
+	int min_bucket = max(min_adj - OOM_DISABLE, 0);
+	struct lowmem_entry *e;
+
+	for (; bucket >= min_bucket && !victim->task; bucket--) {
+		list_for_each_entry(e, &lowmem_bucket[bucket], list) {
+			struct task_struct *p;
+
+			p = find_task_by_pid_ns(e->tgid, &init_pid_ns);
+			if (p)
+				lowmem_consider(victim, p, min_adj);
+		}
+	}
+}
+
+static void lowmem_select_all(struct lowmem_victim *victim, int min_adj)
+{
+	struct task_struct *p;
+
+	for_each_process(p)
+		lowmem_consider(victim, p, min_adj);
+}
+
+static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct lowmem_victim victim;
+	ktime_t start;
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES);
@@ -106,11 +352,17 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 	 * If we already have a death outstanding, then
 	 * bail out right away; indicating to vmscan
 	 * that we have nothing further to offer on
-	 * this pass.
+	 * this pass. A victim that takes longer than
+	 * deathpending_timeout_ms to die no longer
+	 * holds off further kills.
 	 *
 	 */
-	if (lowmem_deathpending)
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		if (nr_to_scan > 0)
+			lowmem_stat_ratelimited++;
 		return 0;
+	}
 
 	if (lowmem_adj_size < array_size)
 		array_size = lowmem_adj_size;
@@ -147,55 +399,42 @@ static int lowmem_shrink(int nr_to_scan, gfp_t gfp_mask)
 			     nr_to_scan, gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
+	/* someone else is already picking a victim */
+	if (!mutex_trylock(&lowmem_lock))
+		return 0;
+	start = ktime_get();
+	lowmem_stat_scans++;
+
+	victim.task = NULL;
+	victim.tasksize = 0;
+	victim.oom_adj = min_adj;
 
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
+	spin_lock(&lowmem_index_lock);
+	if (lowmem_index_ready)
+		lowmem_select_indexed(&victim, min_adj);
+	else
+		lowmem_select_all(&victim, min_adj);
+	spin_unlock(&lowmem_index_lock);
+	if (victim.task) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		task_free_register(&task_nb);
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
+			     victim.task->pid, victim.task->comm,
+			     victim.oom_adj, victim.tasksize);
+		if (!lowmem_deathpending)
+			task_free_register(&task_nb);
+		lowmem_deathpending = victim.task;
+		lowmem_deathpending_timeout = jiffies +
+			msecs_to_jiffies(lowmem_deathpending_timeout_ms);
+		force_sig(SIGKILL, victim.task);
+		rem -= victim.tasksize;
+		lowmem_stat_kills++;
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
 	read_unlock(&tasklist_lock);
+
+	lowmem_stat_scan_us += ktime_to_us(ktime_sub(ktime_get(), start));
+	mutex_unlock(&lowmem_lock);
 	return rem;
 }
 
@@ -206,6 +445,11 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	spin_lock(&lowmem_index_lock);
+	lowmem_index_clear();
+	spin_unlock(&lowmem_index_lock);
+	register_oom_adj_notifier(&oom_adj_nb);
+	lowmem_rebuild_index(NULL);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
@@ -213,6 +457,11 @@ static int __init lowmem_init(void)
 static void __exit lowmem_exit(void)
 {
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+	cancel_work_sync(&lowmem_rebuild_work);
+	spin_lock(&lowmem_index_lock);
+	lowmem_index_clear();
+	spin_unlock(&lowmem_index_lock);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -221,6 +470,13 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(deathpending_timeout_ms, lowmem_deathpending_timeout_ms,
+		   uint, S_IRUGO | S_IWUSR);
+module_param_named(stat_scans, lowmem_stat_scans, uint, S_IRUGO);
+module_param_named(stat_rebuilds, lowmem_stat_rebuilds, uint, S_IRUGO);
+module_param_named(stat_kills, lowmem_stat_kills, uint, S_IRUGO);
+module_param_named(stat_ratelimited, lowmem_stat_ratelimited, uint, S_IRUGO);
+module_param_named(stat_scan_us, lowmem_stat_scan_us, uint, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
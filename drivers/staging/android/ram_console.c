@@ -26,6 +26,13 @@
 #include <linux/rslib.h>
 #endif
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
+#include <linux/lzo.h>
+#include <linux/mutex.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#endif
+
 struct ram_console_buffer {
 	uint32_t    sig;
 	uint32_t    start;
@@ -113,12 +120,422 @@ static void ram_console_update_header(void)
 #endif
 }
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
+/*
+ * In history mode the buffer holds a header, two live areas and a ring of
+ * lzo compressed records. Console output goes uncompressed into the live
+ * area of the current boot, the two are used on alternate boots. A
+ * deferrable work compresses each full block of it into a record, the tail
+ * that was not compressed when the previous boot ended is still in the
+ * other live area and is compressed the first time the work runs. The
+ * oldest records are dropped to make room, so the ring holds as many boots
+ * as fit.
+ */
+struct ram_console_history {
+	uint32_t    sig;
+	uint32_t    boot;
+	uint32_t    written;	/* bytes written to the live area */
+	uint32_t    flushed;	/* of which compressed into records */
+	uint32_t    first;	/* offset of the oldest record */
+	uint32_t    next;	/* offset of the next record */
+	uint32_t    nrecords;
+	uint8_t     data[0];
+};
+
+struct ram_console_record {
+	uint32_t    sig;
+	uint32_t    boot;
+	uint32_t    len;	/* stored size, orig_len if not compressed */
+	uint32_t    orig_len;
+	uint8_t     data[0];
+};
+
+#define RAM_CONSOLE_HISTORY_SIG (0x48474244) /* DBGH */
+#define RAM_CONSOLE_RECORD_SIG (0x52474244) /* DBGR */
+#define RAM_CONSOLE_WRAP_SIG (0x57474244) /* DBGW */
+#define RAM_CONSOLE_LIVE_SIZE CONFIG_ANDROID_RAM_CONSOLE_HISTORY_LIVE_SIZE
+#define RAM_CONSOLE_BLOCK_SIZE 4096
+
+static struct ram_console_history *ram_console_history;
+static uint8_t *ram_console_records;
+static uint32_t ram_console_records_size;
+/* the previous boot, until its live area is compressed */
+static int ram_console_old_pending;
+static uint32_t ram_console_old_boot;
+static uint32_t ram_console_old_written;
+static uint32_t ram_console_old_flushed;
+/* protects the records and the buffers below */
+static DEFINE_MUTEX(ram_console_history_lock);
+static void *ram_console_lzo_wrkmem;
+static uint8_t *ram_console_lzo_buf;
+static uint8_t *ram_console_block_buf;
+static struct delayed_work ram_console_flush_work;
+
+static uint8_t *ram_console_live(uint32_t boot)
+{
+	return ram_console_history->data + (boot & 1) * RAM_CONSOLE_LIVE_SIZE;
+}
+
+static void ram_console_history_write(const char *s, unsigned int count)
+{
+	struct ram_console_history *h = ram_console_history;
+	uint8_t *live = ram_console_live(h->boot);
+
+	if (count > RAM_CONSOLE_LIVE_SIZE) {
+		h->written += count - RAM_CONSOLE_LIVE_SIZE;
+		s += count - RAM_CONSOLE_LIVE_SIZE;
+		count = RAM_CONSOLE_LIVE_SIZE;
+	}
+	while (count) {
+		uint32_t pos = h->written % RAM_CONSOLE_LIVE_SIZE;
+		uint32_t n = min_t(uint32_t, count,
+				   RAM_CONSOLE_LIVE_SIZE - pos);
+		memcpy(live + pos, s, n);
+		h->written += n;
+		s += n;
+		count -= n;
+	}
+}
+
+static struct ram_console_record *ram_console_record_get(uint32_t offset)
+{
+	struct ram_console_record *rec;
+
+	if (offset > ram_console_records_size - sizeof(*rec))
+		return NULL;
+	rec = (struct ram_console_record *)(ram_console_records + offset);
+	if (rec->sig != RAM_CONSOLE_RECORD_SIG ||
+	    rec->len > ram_console_records_size - offset - sizeof(*rec) ||
+	    rec->orig_len > RAM_CONSOLE_BLOCK_SIZE ||
+	    rec->len > rec->orig_len)
+		return NULL;
+	return rec;
+}
+
+/* returns the offset of the record following rec, which is at offset */
+static uint32_t
+ram_console_record_next(struct ram_console_record *rec, uint32_t offset)
+{
+	struct ram_console_record *next;
+
+	offset += ALIGN(sizeof(*rec) + rec->len, 4);
+	if (offset > ram_console_records_size - sizeof(*rec))
+		return 0;
+	next = (struct ram_console_record *)(ram_console_records + offset);
+	if (next->sig == RAM_CONSOLE_WRAP_SIG)
+		return 0;
+	return offset;
+}
+
+static void ram_console_history_reset(void)
+{
+	struct ram_console_history *h = ram_console_history;
+
+	h->first = 0;
+	h->next = 0;
+	h->nrecords = 0;
+}
+
+static void ram_console_history_drop_oldest(void)
+{
+	struct ram_console_history *h = ram_console_history;
+	struct ram_console_record *rec = ram_console_record_get(h->first);
+
+	if (rec == NULL || --h->nrecords == 0) {
+		ram_console_history_reset();
+		return;
+	}
+	h->first = ram_console_record_next(rec, h->first);
+}
+
+/* drop the oldest records until need bytes are free at h->next */
+static void ram_console_history_make_room(uint32_t need)
+{
+	struct ram_console_history *h = ram_console_history;
+
+	for (;;) {
+		if (h->nrecords == 0) {
+			ram_console_history_reset();
+			return;
+		}
+		if (h->next > h->first) {
+			struct ram_console_record *wrap;
+
+			if (ram_console_records_size - h->next >= need)
+				return;
+			if (ram_console_records_size - h->next >= sizeof(*wrap)) {
+				wrap = (struct ram_console_record *)
+					(ram_console_records + h->next);
+				wrap->sig = RAM_CONSOLE_WRAP_SIG;
+			}
+			h->next = 0;
+		} else if (h->first - h->next >= need)
+			return;
+		else
+			ram_console_history_drop_oldest();
+	}
+}
+
+static void
+ram_console_history_add(uint32_t boot, const uint8_t *src, uint32_t len)
+{
+	struct ram_console_history *h = ram_console_history;
+	struct ram_console_record *rec;
+	const uint8_t *data = src;
+	size_t clen;
+
+	if (lzo1x_1_compress(src, len, ram_console_lzo_buf, &clen,
+			     ram_console_lzo_wrkmem) == LZO_E_OK && clen < len)
+		data = ram_console_lzo_buf;
+	else
+		clen = len;
+
+	ram_console_history_make_room(ALIGN(sizeof(*rec) + clen, 4));
+	rec = (struct ram_console_record *)(ram_console_records + h->next);
+	rec->sig = RAM_CONSOLE_RECORD_SIG;
+	rec->boot = boot;
+	rec->len = clen;
+	rec->orig_len = len;
+	memcpy(rec->data, data, clen);
+	h->next += ALIGN(sizeof(*rec) + clen, 4);
+	h->nrecords++;
+	/* keep h->next where ram_console_record_next would go */
+	if (h->next > ram_console_records_size - sizeof(*rec))
+		h->next = 0;
+	/* a stale wrap marker after the last record would hide it */
+	else if (h->next != h->first) {
+		rec = (struct ram_console_record *)
+			(ram_console_records + h->next);
+		rec->sig = 0;
+	}
+}
+
+/*
+ * Compress the live area of boot into records, block by block. The tail
+ * that does not fill a block is only compressed if partial is set.
+ */
+static void ram_console_history_flush(uint32_t boot, uint32_t *flushed,
+				      uint32_t *written, int partial)
+{
+	uint8_t *live = ram_console_live(boot);
+	uint32_t end = ACCESS_ONCE(*written);
+
+	if (end - *flushed > RAM_CONSOLE_LIVE_SIZE)
+		*flushed = end - RAM_CONSOLE_LIVE_SIZE;
+	while (end - *flushed >= RAM_CONSOLE_BLOCK_SIZE ||
+	       (partial && end != *flushed)) {
+		uint32_t start = *flushed;
+		uint32_t len = min_t(uint32_t, end - start,
+				     RAM_CONSOLE_BLOCK_SIZE);
+		uint32_t pos = start % RAM_CONSOLE_LIVE_SIZE;
+		uint32_t part = min_t(uint32_t, len,
+				      RAM_CONSOLE_LIVE_SIZE - pos);
+
+		memcpy(ram_console_block_buf, live + pos, part);
+		memcpy(ram_console_block_buf + part, live, len - part);
+		*flushed = start + len;
+		/* skip the block if the console overwrote it meanwhile */
+		if (ACCESS_ONCE(*written) - start <= RAM_CONSOLE_LIVE_SIZE)
+			ram_console_history_add(boot, ram_console_block_buf,
+						len);
+	}
+}
+
+static void ram_console_history_fold_old(void)
+{
+	if (!ram_console_old_pending)
+		return;
+	ram_console_history_flush(ram_console_old_boot,
+				  &ram_console_old_flushed,
+				  &ram_console_old_written, 1);
+	ram_console_old_pending = 0;
+}
+
+static void ram_console_history_work(struct work_struct *work)
+{
+	struct ram_console_history *h = ram_console_history;
+
+	mutex_lock(&ram_console_history_lock);
+	ram_console_history_fold_old();
+	ram_console_history_flush(h->boot, &h->flushed, &h->written, 0);
+	mutex_unlock(&ram_console_history_lock);
+	schedule_delayed_work(&ram_console_flush_work, HZ);
+}
+
+static int __init
+ram_console_history_init(struct ram_console_buffer *buffer, size_t buffer_size)
+{
+	struct ram_console_history *h = (struct ram_console_history *)buffer;
+	struct ram_console_record *rec;
+	uint32_t offset;
+	int i;
+	char banner[48];
+
+	if (buffer_size < sizeof(*h) + 2 * RAM_CONSOLE_LIVE_SIZE +
+	    sizeof(*rec) + lzo1x_worst_compress(RAM_CONSOLE_BLOCK_SIZE) ||
+	    RAM_CONSOLE_LIVE_SIZE < RAM_CONSOLE_BLOCK_SIZE) {
+		pr_err("ram_console: buffer %p, size %zu too small for "
+		       "history\n", buffer, buffer_size);
+		return -EINVAL;
+	}
+	ram_console_history = h;
+	ram_console_records = h->data + 2 * RAM_CONSOLE_LIVE_SIZE;
+	ram_console_records_size = buffer_size - sizeof(*h) -
+				   2 * RAM_CONSOLE_LIVE_SIZE;
+
+	/* only the record headers are checked, nothing is copied */
+	offset = h->first;
+	for (i = 0; h->sig == RAM_CONSOLE_HISTORY_SIG && i < h->nrecords; i++) {
+		rec = ram_console_record_get(offset);
+		if (rec == NULL)
+			break;
+		offset = ram_console_record_next(rec, offset);
+	}
+	if (h->sig != RAM_CONSOLE_HISTORY_SIG || i < h->nrecords ||
+	    offset != (h->nrecords ? h->next : h->first)) {
+		printk(KERN_INFO "ram_console: no valid history in buffer "
+		       "(sig = 0x%08x)\n", h->sig);
+		h->sig = RAM_CONSOLE_HISTORY_SIG;
+		h->boot = 0;
+		ram_console_history_reset();
+	} else {
+		printk(KERN_INFO "ram_console: found history of %u records, "
+		       "boot %u\n", h->nrecords, h->boot);
+		ram_console_old_boot = h->boot;
+		ram_console_old_written = h->written;
+		ram_console_old_flushed = h->flushed;
+		ram_console_old_pending = h->written != h->flushed;
+		h->boot++;
+	}
+	h->written = 0;
+	h->flushed = 0;
+
+	snprintf(banner, sizeof(banner), "\n[ram_console: boot %u]\n",
+		 h->boot);
+	ram_console_history_write(banner, strlen(banner));
+	return 0;
+}
+
+static ssize_t ram_console_read_history(struct file *file, char __user *buf,
+					size_t len, loff_t *offset)
+{
+	struct ram_console_history *h = ram_console_history;
+	struct ram_console_record *rec;
+	uint8_t *block;
+	loff_t pos = *offset;
+	uint32_t record;
+	ssize_t count = 0;
+	size_t block_len;
+	int i;
+
+	block = kmalloc(RAM_CONSOLE_BLOCK_SIZE, GFP_KERNEL);
+	if (block == NULL)
+		return -ENOMEM;
+
+	/* find and unpack the record holding pos, older boots only */
+	mutex_lock(&ram_console_history_lock);
+	ram_console_history_fold_old();
+	record = h->first;
+	for (i = 0; i < h->nrecords; i++) {
+		rec = ram_console_record_get(record);
+		if (rec == NULL || rec->boot == h->boot)
+			break;
+		if (pos < rec->orig_len) {
+			block_len = rec->orig_len;
+			if (rec->len == rec->orig_len)
+				memcpy(block, rec->data, rec->len);
+			else if (lzo1x_decompress_safe(rec->data, rec->len,
+						block, &block_len) != LZO_E_OK ||
+				 block_len != rec->orig_len)
+				break;
+			count = min(len, (size_t)(block_len - pos));
+			break;
+		}
+		pos -= rec->orig_len;
+		record = ram_console_record_next(rec, record);
+	}
+	mutex_unlock(&ram_console_history_lock);
+
+	if (count && copy_to_user(buf, block + pos, count))
+		count = -EFAULT;
+	else
+		*offset += count;
+	kfree(block);
+	return count;
+}
+
+static struct file_operations ram_console_history_file_ops = {
+	.owner = THIS_MODULE,
+	.read = ram_console_read_history,
+};
+
+static int __init ram_console_history_late_init(void)
+{
+	struct ram_console_history *h = ram_console_history;
+	struct ram_console_record *rec;
+	struct proc_dir_entry *entry;
+	uint32_t record;
+	loff_t size = 0;
+	int i;
+
+	if (h == NULL)
+		return 0;
+
+	ram_console_lzo_wrkmem = vmalloc(LZO1X_MEM_COMPRESS);
+	ram_console_lzo_buf = kmalloc(
+		lzo1x_worst_compress(RAM_CONSOLE_BLOCK_SIZE), GFP_KERNEL);
+	ram_console_block_buf = kmalloc(RAM_CONSOLE_BLOCK_SIZE, GFP_KERNEL);
+	if (!ram_console_lzo_wrkmem || !ram_console_lzo_buf ||
+	    !ram_console_block_buf) {
+		printk(KERN_ERR
+		       "ram_console: failed to allocate compression buffers\n");
+		vfree(ram_console_lzo_wrkmem);
+		kfree(ram_console_lzo_buf);
+		kfree(ram_console_block_buf);
+		return 0;
+	}
+	INIT_DELAYED_WORK_DEFERRABLE(&ram_console_flush_work,
+				     ram_console_history_work);
+	schedule_delayed_work(&ram_console_flush_work, 0);
+
+	/* the size is only an estimate, the work may not have run yet */
+	record = h->first;
+	for (i = 0; i < h->nrecords; i++) {
+		rec = ram_console_record_get(record);
+		if (rec == NULL || rec->boot == h->boot)
+			break;
+		size += rec->orig_len;
+		record = ram_console_record_next(rec, record);
+	}
+	if (ram_console_old_pending)
+		size += min_t(uint32_t, RAM_CONSOLE_LIVE_SIZE,
+			      ram_console_old_written -
+			      ram_console_old_flushed);
+	if (size == 0)
+		return 0;
+
+	entry = create_proc_entry("last_kmsg", S_IFREG | S_IRUGO, NULL);
+	if (!entry) {
+		printk(KERN_ERR "ram_console: failed to create proc entry\n");
+		return 0;
+	}
+
+	entry->proc_fops = &ram_console_history_file_ops;
+	entry->size = size;
+	return 0;
+}
+#endif
+
 static void
 ram_console_write(struct console *console, const char *s, unsigned int count)
 {
 	int rem;
 	struct ram_console_buffer *buffer = ram_console_buffer;
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
+	ram_console_history_write(s, count);
+	return;
+#endif
 	if (count > ram_console_buffer_size) {
 		s += count - ram_console_buffer_size;
 		count = ram_console_buffer_size;
@@ -154,6 +571,7 @@ void ram_console_enable_console(int enabled)
 		ram_console.flags &= ~CON_ENABLED;
 }
 
+#ifndef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
 static void __init
 ram_console_save_old(struct ram_console_buffer *buffer, char *dest)
 {
@@ -220,6 +638,7 @@ ram_console_save_old(struct ram_console_buffer *buffer, char *dest)
 	       strbuf, strbuf_len);
 #endif
 }
+#endif
 
 static int __init ram_console_init(struct ram_console_buffer *buffer,
 				   size_t buffer_size, char *old_buf)
@@ -238,6 +657,10 @@ static int __init ram_console_init(struct ram_console_buffer *buffer,
 		return 0;
 	}
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
+	if (ram_console_history_init(buffer, buffer_size))
+		return 0;
+#else
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ERROR_CORRECTION
 	ram_console_buffer_size -= (DIV_ROUND_UP(ram_console_buffer_size,
 						ECC_BLOCK_SIZE) + 1) * ECC_SIZE;
@@ -298,6 +721,7 @@ static int __init ram_console_init(struct ram_console_buffer *buffer,
 	buffer->sig = RAM_CONSOLE_SIG;
 	buffer->start = 0;
 	buffer->size = 0;
+#endif
 
 	register_console(&ram_console);
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_ENABLE_VERBOSE
@@ -382,6 +806,9 @@ static int __init ram_console_late_init(void)
 {
 	struct proc_dir_entry *entry;
 
+#ifdef CONFIG_ANDROID_RAM_CONSOLE_HISTORY
+	return ram_console_history_late_init();
+#endif
 	if (ram_console_old_log == NULL)
 		return 0;
 #ifdef CONFIG_ANDROID_RAM_CONSOLE_EARLY_INIT
@@ -23,6 +23,8 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
 #include <linux/lzo.h>
 #include <linux/slab.h>
 #include <linux/string.h>
@@ -39,6 +41,8 @@ static unsigned int num_devices;
 static unsigned long disksize_kb;
 static unsigned long memlimit_kb;
 static char backing_swap[MAX_SWAP_NAME_LEN];
+static unsigned int max_comp_streams;
+static int dedup = 1;
 
 /* Globals */
 static int ramzswap_major;
@@ -257,6 +261,7 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 
 	s->disksize = rzs->disksize;
 	s->memlimit = rzs->memlimit;
+	strncpy(s->compressor, rzs->compressor, MAX_COMPRESSOR_NAME_LEN);
 
 #if defined(CONFIG_RAMZSWAP_STATS)
 	{
@@ -283,6 +288,7 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->invalid_io = stat64_read(rzs, &rs->invalid_io);
 	s->notify_free = stat64_read(rzs, &rs->notify_free);
 	s->pages_zero = rs->pages_zero;
+	s->pages_dedup = rs->pages_dedup;
 
 	s->good_compress_pct = good_compress_perc;
 	s->pages_expand_pct = no_compress_perc;
@@ -295,6 +301,12 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 
 	s->bdev_num_reads = stat64_read(rzs, &rs->bdev_num_reads);
 	s->bdev_num_writes = stat64_read(rzs, &rs->bdev_num_writes);
+	s->stream_waits = stat64_read(rzs, &rs->stream_waits);
+
+	s->num_compr = stat64_read(rzs, &rs->num_compr);
+	s->num_decompr = stat64_read(rzs, &rs->num_decompr);
+	s->compr_ns = stat64_read(rzs, &rs->compr_ns);
+	s->decompr_ns = stat64_read(rzs, &rs->decompr_ns);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
@@ -616,11 +628,264 @@ static u32 map_backing_swap_page(struct ramzswap *rzs, u32 pagenum)
 	return se->phy_pagenum + se_offset;
 }
 
-static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+static void comp_stream_free(struct ramzswap_comp_stream *zstrm)
+{
+	if (zstrm->tfm)
+		crypto_free_comp(zstrm->tfm);
+	kfree(zstrm->workmem);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct ramzswap_comp_stream *comp_stream_alloc(struct ramzswap *rzs)
+{
+	struct ramzswap_comp_stream *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	if (rzs->use_crypto) {
+		zstrm->tfm = crypto_alloc_comp(rzs->compressor, 0, 0);
+		if (IS_ERR(zstrm->tfm)) {
+			zstrm->tfm = NULL;
+			goto fail;
+		}
+	} else {
+		zstrm->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		if (!zstrm->workmem)
+			goto fail;
+	}
+
+	/*
+	 * Allocate 2 pages: the compressed output of an incompressible
+	 * page can exceed PAGE_SIZE.
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!zstrm->buffer)
+		goto fail;
+
+	return zstrm;
+
+fail:
+	comp_stream_free(zstrm);
+	return NULL;
+}
+
+static void destroy_comp_streams(struct ramzswap *rzs)
+{
+	struct ramzswap_comp_stream *zstrm;
+
+	while (!list_empty(&rzs->idle_streams)) {
+		zstrm = list_first_entry(&rzs->idle_streams,
+				struct ramzswap_comp_stream, list);
+		list_del(&zstrm->list);
+		comp_stream_free(zstrm);
+	}
+	rzs->num_streams = 0;
+}
+
+/*
+ * One stream per online CPU by default, since that is how many
+ * reclaim contexts can be compressing at the same time.
+ */
+static int create_comp_streams(struct ramzswap *rzs)
+{
+	unsigned int i, nr_streams;
+	struct ramzswap_comp_stream *zstrm;
+
+	nr_streams = max_comp_streams;
+	if (!nr_streams)
+		nr_streams = num_online_cpus();
+
+	rzs->use_crypto = strcmp(rzs->compressor, default_compressor) != 0;
+
+	for (i = 0; i < nr_streams; i++) {
+		zstrm = comp_stream_alloc(rzs);
+		if (!zstrm) {
+			destroy_comp_streams(rzs);
+			return -ENOMEM;
+		}
+		list_add(&zstrm->list, &rzs->idle_streams);
+		rzs->num_streams++;
+	}
+
+	return 0;
+}
+
+/*
+ * Get an idle compression stream, sleeping until one is
+ * released if all of them are in use.
+ */
+static struct ramzswap_comp_stream *comp_stream_get(struct ramzswap *rzs)
+{
+	struct ramzswap_comp_stream *zstrm;
+
+	for (;;) {
+		spin_lock(&rzs->stream_lock);
+		if (!list_empty(&rzs->idle_streams)) {
+			zstrm = list_first_entry(&rzs->idle_streams,
+					struct ramzswap_comp_stream, list);
+			list_del(&zstrm->list);
+			spin_unlock(&rzs->stream_lock);
+			return zstrm;
+		}
+		spin_unlock(&rzs->stream_lock);
+
+		stat64_inc(rzs, &rzs->stats.stream_waits);
+		wait_event(rzs->stream_wait,
+			!list_empty(&rzs->idle_streams));
+	}
+}
+
+static void comp_stream_put(struct ramzswap *rzs,
+			struct ramzswap_comp_stream *zstrm)
+{
+	spin_lock(&rzs->stream_lock);
+	list_add(&zstrm->list, &rzs->idle_streams);
+	spin_unlock(&rzs->stream_lock);
+
+	wake_up(&rzs->stream_wait);
+}
+
+/*
+ * Compress one page from src into zstrm->buffer.
+ * Returns 0 on success.
+ */
+static int ramzswap_compress(struct ramzswap *rzs,
+			struct ramzswap_comp_stream *zstrm,
+			const unsigned char *src, size_t *clen)
+{
+	int ret;
+	unsigned int dlen;
+	ktime_t start = ktime_get();
+
+	if (likely(!zstrm->tfm)) {
+		ret = lzo1x_1_compress(src, PAGE_SIZE, zstrm->buffer, clen,
+					zstrm->workmem);
+	} else {
+		dlen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+					zstrm->buffer, &dlen);
+		*clen = dlen;
+	}
+
+	stat64_add(rzs, &rzs->stats.compr_ns,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
+	stat64_inc(rzs, &rzs->stats.num_compr);
+
+	return ret;
+}
+
+/*
+ * Decompress slen bytes at src into the page at dst.
+ * Returns 0 on success. zstrm is only needed for crypto compressors.
+ */
+static int ramzswap_decompress(struct ramzswap *rzs,
+			struct ramzswap_comp_stream *zstrm,
+			const unsigned char *src, size_t slen,
+			unsigned char *dst)
+{
+	int ret;
+	size_t clen = PAGE_SIZE;
+	unsigned int dlen = PAGE_SIZE;
+	ktime_t start = ktime_get();
+
+	if (likely(!zstrm))
+		ret = lzo1x_decompress_safe(src, slen, dst, &clen);
+	else
+		ret = crypto_comp_decompress(zstrm->tfm, src, slen,
+					dst, &dlen);
+
+	stat64_add(rzs, &rzs->stats.decompr_ns,
+		ktime_to_ns(ktime_sub(ktime_get(), start)));
+	stat64_inc(rzs, &rzs->stats.num_decompr);
+
+	return ret;
+}
+
+static u32 page_hash(void *ptr)
+{
+	return jhash2(ptr, PAGE_SIZE / sizeof(u32), 0);
+}
+
+static struct hlist_head *dedup_bucket(struct ramzswap *rzs, u32 hash)
+{
+	return &rzs->dedup_hash[hash & ((1 << RZS_DEDUP_HASH_BITS) - 1)];
+}
+
+/*
+ * Drop one reference to a dedup entry. Returns the number of
+ * references left; the entry is freed once this drops to zero and
+ * the caller then owns the object.
+ */
+static u32 dedup_put_entry(struct ramzswap *rzs, struct rzs_dedup_entry *e)
+{
+	u32 refcount;
+
+	spin_lock(&rzs->dedup_lock);
+	refcount = --e->refcount;
+	if (!refcount)
+		hlist_del(&e->node);
+	spin_unlock(&rzs->dedup_lock);
+
+	if (!refcount)
+		kfree(e);
+
+	return refcount;
+}
+
+/*
+ * Drop the reference held by the table entry pointing
+ * to <page, offset>. Returns the number of references left.
+ */
+static u32 dedup_put_object(struct ramzswap *rzs, u32 hash,
+			struct page *page, u32 offset)
+{
+	struct rzs_dedup_entry *e;
+	struct hlist_node *pos;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(e, pos, dedup_bucket(rzs, hash), node) {
+		if (e->page == page && e->offset == offset) {
+			spin_unlock(&rzs->dedup_lock);
+			return dedup_put_entry(rzs, e);
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+
+	/* should NEVER happen */
+	pr_err("Object not found in dedup index: page=%p, offset=%u\n",
+		page, offset);
+	return 0;
+}
+
+static void dedup_insert(struct ramzswap *rzs, struct rzs_dedup_entry *e)
+{
+	spin_lock(&rzs->dedup_lock);
+	hlist_add_head(&e->node, dedup_bucket(rzs, e->hash));
+	spin_unlock(&rzs->dedup_lock);
+}
+
+static void ramzswap_free_object(struct ramzswap *rzs,
+			struct page *page, u32 offset)
 {
 	u32 clen;
 	void *obj;
 
+	obj = kmap_atomic(page, KM_USER0) + offset;
+	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	kunmap_atomic(obj, KM_USER0);
+
+	xv_free(rzs->mem_pool, page, offset);
+	rzs->stats.compr_size -= clen;
+}
+
+static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
+{
+	u32 clen, hash;
+	void *obj;
+
 	struct page *page = rzs->table[index].page;
 	u32 offset = rzs->table[index].offset;
 
@@ -646,12 +911,24 @@ static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 
 	obj = kmap_atomic(page, KM_USER0) + offset;
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+	hash = ((struct zobj_header *)obj)->hash;
 	kunmap_atomic(obj, KM_USER0);
 
-	xv_free(rzs->mem_pool, page, offset);
 	if (clen <= PAGE_SIZE / 2)
 		stat_dec(&rzs->stats.good_compress);
 
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		rzs_clear_flag(rzs, index, RZS_DEDUP);
+		/* Object is still used by an identical page */
+		if (dedup_put_object(rzs, hash, page, offset)) {
+			stat_dec(&rzs->stats.pages_dedup);
+			clen = 0;
+			goto out;
+		}
+	}
+
+	xv_free(rzs->mem_pool, page, offset);
+
 out:
 	rzs->stats.compr_size -= clen;
 	stat_dec(&rzs->stats.pages_stored);
@@ -750,9 +1027,9 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
 	u32 index;
-	size_t clen;
 	struct page *page;
 	struct zobj_header *zheader;
+	struct ramzswap_comp_stream *zstrm = NULL;
 	unsigned char *user_mem, *cmem;
 
 	stat64_inc(rzs, &rzs->stats.num_reads);
@@ -771,22 +1048,28 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		return handle_uncompressed_page(rzs, bio);
 
+	/* Crypto compressors keep per-transform state */
+	if (unlikely(rzs->use_crypto))
+		zstrm = comp_stream_get(rzs);
+
 	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
 
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-	ret = lzo1x_decompress_safe(
+	ret = ramzswap_decompress(rzs, zstrm,
 		cmem + sizeof(*zheader),
 		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+		user_mem);
 
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
 
+	if (zstrm)
+		comp_stream_put(rzs, zstrm);
+
 	/* should NEVER happen */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n",
 			ret, index);
 		stat64_inc(rzs, &rzs->stats.failed_reads);
@@ -804,13 +1087,77 @@ out:
 	return 0;
 }
 
+/*
+ * Look for a stored object with the same content as page. On success,
+ * a reference to its dedup entry is returned. Only the first entry with
+ * a matching hash is considered; its content is verified by decompressing
+ * it into the stream buffer.
+ */
+static struct rzs_dedup_entry *dedup_find(struct ramzswap *rzs,
+			struct ramzswap_comp_stream *zstrm,
+			struct page *page, u32 hash)
+{
+	int ret;
+	u32 offset;
+	struct page *obj_page;
+	struct rzs_dedup_entry *e;
+	struct hlist_node *pos;
+	unsigned char *user_mem, *cmem;
+
+	spin_lock(&rzs->dedup_lock);
+	hlist_for_each_entry(e, pos, dedup_bucket(rzs, hash), node) {
+		if (e->hash == hash) {
+			e->refcount++;
+			goto found;
+		}
+	}
+	spin_unlock(&rzs->dedup_lock);
+	return NULL;
+
+found:
+	spin_unlock(&rzs->dedup_lock);
+
+	cmem = kmap_atomic(e->page, KM_USER1) + e->offset;
+	ret = ramzswap_decompress(rzs, rzs->use_crypto ? zstrm : NULL,
+		cmem + sizeof(struct zobj_header),
+		xv_get_object_size(cmem) - sizeof(struct zobj_header),
+		zstrm->buffer);
+	kunmap_atomic(cmem, KM_USER1);
+
+	if (likely(!ret)) {
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = memcmp(user_mem, zstrm->buffer, PAGE_SIZE);
+		kunmap_atomic(user_mem, KM_USER0);
+		if (!ret)
+			return e;
+	}
+
+	/*
+	 * Hash collision. If the other owners went away meanwhile, the
+	 * last of them counted our reference as a duplicate page. The
+	 * object is then ours to free, under rzs->lock like any other.
+	 */
+	obj_page = e->page;
+	offset = e->offset;
+	if (!dedup_put_entry(rzs, e)) {
+		mutex_lock(&rzs->lock);
+		ramzswap_free_object(rzs, obj_page, offset);
+		stat_inc(&rzs->stats.pages_dedup);
+		mutex_unlock(&rzs->lock);
+	}
+
+	return NULL;
+}
+
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret, fwd_write_request = 0;
-	u32 offset, index;
+	u32 offset, index, hash = 0;
 	size_t clen;
 	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	struct page *page, *page_store = NULL;
+	struct ramzswap_comp_stream *zstrm;
+	struct rzs_dedup_entry *dedup_entry = NULL;
 	unsigned char *user_mem, *cmem, *src;
 
 	stat64_inc(rzs, &rzs->stats.num_writes);
@@ -818,8 +1165,6 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
 #ifndef CONFIG_SWAP_FREE_NOTIFY
 	/*
 	 * System swaps to same sector again when the stored page
@@ -830,35 +1175,49 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		ramzswap_free_page(rzs, index);
 #endif
 
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (page_zero_filled(user_mem)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		mutex_lock(&rzs->lock);
 		rzs_set_flag(rzs, index, RZS_ZERO);
-		mutex_unlock(&rzs->lock);
 		stat_inc(&rzs->stats.pages_zero);
+		mutex_unlock(&rzs->lock);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	if (dedup)
+		hash = page_hash(user_mem);
+	kunmap_atomic(user_mem, KM_USER0);
 
 	if (rzs->backing_swap &&
 		(rzs->stats.compr_size > rzs->memlimit - PAGE_SIZE)) {
-		kunmap_atomic(user_mem, KM_USER0);
-		mutex_unlock(&rzs->lock);
 		fwd_write_request = 1;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/* Compress without holding rzs->lock */
+	zstrm = comp_stream_get(rzs);
+	src = zstrm->buffer;
 
+	if (dedup) {
+		dedup_entry = dedup_find(rzs, zstrm, page, hash);
+		if (dedup_entry) {
+			comp_stream_put(rzs, zstrm);
+			goto store_dup;
+		}
+		/* Index the new object; dedup is skipped if this fails */
+		dedup_entry = kmalloc(sizeof(*dedup_entry), GFP_NOIO);
+	}
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = ramzswap_compress(rzs, zstrm, user_mem, &clen);
 	kunmap_atomic(user_mem, KM_USER0);
 
-	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+	if (unlikely(ret)) {
+		comp_stream_put(rzs, zstrm);
+		kfree(dedup_entry);
 		pr_err("Compression failed! err=%d\n", ret);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
@@ -871,8 +1230,12 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		comp_stream_put(rzs, zstrm);
+		zstrm = NULL;
+		kfree(dedup_entry);
+		dedup_entry = NULL;
+
 		if (rzs->backing_swap) {
-			mutex_unlock(&rzs->lock);
 			fwd_write_request = 1;
 			goto out;
 		}
@@ -880,13 +1243,16 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
-			mutex_unlock(&rzs->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			stat64_inc(rzs, &rzs->stats.failed_writes);
 			goto out;
 		}
+	}
 
+	mutex_lock(&rzs->lock);
+
+	if (unlikely(page_store)) {
 		offset = 0;
 		rzs_set_flag(rzs, index, RZS_UNCOMPRESSED);
 		stat_inc(&rzs->stats.pages_expand);
@@ -899,6 +1265,8 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 			&rzs->table[index].page, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
 		mutex_unlock(&rzs->lock);
+		comp_stream_put(rzs, zstrm);
+		kfree(dedup_entry);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -913,14 +1281,15 @@ memstore:
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
+#if 0
+		/* Back-reference needed for memory defragmentation */
 		zheader->table_idx = index;
+#endif
+		zheader->hash = hash;
 		cmem += sizeof(*zheader);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
@@ -928,6 +1297,15 @@ memstore:
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
 
+	if (dedup_entry) {
+		dedup_entry->page = rzs->table[index].page;
+		dedup_entry->offset = offset;
+		dedup_entry->hash = hash;
+		dedup_entry->refcount = 1;
+		dedup_insert(rzs, dedup_entry);
+		rzs_set_flag(rzs, index, RZS_DEDUP);
+	}
+
 	/* Update stats */
 	rzs->stats.compr_size += clen;
 	stat_inc(&rzs->stats.pages_stored);
@@ -936,6 +1314,30 @@ memstore:
 
 	mutex_unlock(&rzs->lock);
 
+	if (zstrm)
+		comp_stream_put(rzs, zstrm);
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
+
+store_dup:
+	/* Share the identical object; no new memory is used */
+	cmem = kmap_atomic(dedup_entry->page, KM_USER1) + dedup_entry->offset;
+	clen = xv_get_object_size(cmem) - sizeof(*zheader);
+	kunmap_atomic(cmem, KM_USER1);
+
+	mutex_lock(&rzs->lock);
+	rzs->table[index].page = dedup_entry->page;
+	rzs->table[index].offset = dedup_entry->offset;
+	rzs_set_flag(rzs, index, RZS_DEDUP);
+
+	stat_inc(&rzs->stats.pages_stored);
+	stat_inc(&rzs->stats.pages_dedup);
+	if (clen <= PAGE_SIZE / 2)
+		stat_inc(&rzs->stats.good_compress);
+	mutex_unlock(&rzs->lock);
+
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
@@ -1040,11 +1442,7 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 	num_pages = rzs->disksize >> PAGE_SHIFT;
 
 	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	destroy_comp_streams(rzs);
 
 	/* Free all pages that are still in this ramzswap device */
 	for (index = 0; index < num_pages; index++) {
@@ -1057,12 +1455,29 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 		if (!page)
 			continue;
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
+		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+			continue;
+		}
+
+		/* Shared objects are freed along with their last user */
+		if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+			u32 hash;
+			struct zobj_header *zheader;
+
+			zheader = kmap_atomic(page, KM_USER0) + offset;
+			hash = zheader->hash;
+			kunmap_atomic(zheader, KM_USER0);
+			if (dedup_put_object(rzs, hash, page, offset))
+				continue;
+		}
+
+		xv_free(rzs->mem_pool, page, offset);
 	}
 
+	vfree(rzs->dedup_hash);
+	rzs->dedup_hash = NULL;
+
 	entries_per_page = PAGE_SIZE / sizeof(*rzs->table);
 	num_table_pages = DIV_ROUND_UP(num_pages * sizeof(*rzs->table),
 					PAGE_SIZE);
@@ -1108,6 +1523,7 @@ static void reset_device(struct ramzswap *rzs, struct block_device *bdev)
 
 	rzs->disksize = 0;
 	rzs->memlimit = 0;
+	strcpy(rzs->compressor, default_compressor);
 }
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
@@ -1133,17 +1549,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	else
 		ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = create_comp_streams(rzs);
+	if (ret) {
+		pr_err("Error allocating compression streams\n");
 		goto fail;
 	}
 
@@ -1158,6 +1566,16 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	rzs->dedup_hash = vmalloc(sizeof(*rzs->dedup_hash) <<
+					RZS_DEDUP_HASH_BITS);
+	if (!rzs->dedup_hash) {
+		pr_err("Error allocating dedup index\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+	memset(rzs->dedup_hash, 0, sizeof(*rzs->dedup_hash) <<
+					RZS_DEDUP_HASH_BITS);
+
 	map_backing_swap_extents(rzs);
 
 	page = alloc_page(__GFP_ZERO);
@@ -1210,11 +1628,15 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	if (rzs->backing_swap) {
 		pr_info("/dev/ramzswap%d initialized: "
-			"backing_swap=%s, memlimit_kb=%zu\n",
-			dev_id, rzs->backing_swap_name, rzs->memlimit >> 10);
+			"backing_swap=%s, memlimit_kb=%zu, compressor=%s, "
+			"streams=%u\n", dev_id, rzs->backing_swap_name,
+			rzs->memlimit >> 10, rzs->compressor,
+			rzs->num_streams);
 	} else {
 		pr_info("/dev/ramzswap%d initialized: "
-			"disksize_kb=%zu", dev_id, rzs->disksize >> 10);
+			"disksize_kb=%zu, compressor=%s, streams=%u\n",
+			dev_id, rzs->disksize >> 10, rzs->compressor,
+			rzs->num_streams);
 	}
 	return 0;
 
@@ -1287,6 +1709,30 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_debug("Backing swap set to %s\n", rzs->backing_swap_name);
 		break;
 
+	case RZSIO_SET_COMPRESSOR:
+	{
+		char name[MAX_COMPRESSOR_NAME_LEN];
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+
+		if (copy_from_user(name, (void *)arg, _IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[MAX_COMPRESSOR_NAME_LEN - 1] = '\0';
+		if (strcmp(name, default_compressor) &&
+				!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strcpy(rzs->compressor, name);
+		pr_debug("Compressor set to %s\n", rzs->compressor);
+		break;
+	}
+
 	case RZSIO_GET_STATS:
 	{
 		struct ramzswap_ioctl_stats *stats;
@@ -1357,6 +1803,11 @@ static int create_device(struct ramzswap *rzs, int device_id)
 
 	mutex_init(&rzs->lock);
 	spin_lock_init(&rzs->stat64_lock);
+	spin_lock_init(&rzs->stream_lock);
+	spin_lock_init(&rzs->dedup_lock);
+	INIT_LIST_HEAD(&rzs->idle_streams);
+	init_waitqueue_head(&rzs->stream_wait);
+	strcpy(rzs->compressor, default_compressor);
 	INIT_LIST_HEAD(&rzs->backing_swap_extent_list);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
@@ -1527,6 +1978,14 @@ static void __exit ramzswap_exit(void)
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
 
+/* Optional: default = 1 */
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share memory between identical pages");
+
+/* Optional: default = number of online CPUs */
+module_param(max_comp_streams, uint, 0);
+MODULE_PARM_DESC(max_comp_streams, "Number of parallel compression streams");
+
 /*
  * User specifies either <disksize_kb> or <backing_swap, memlimit_kb>
  * parameters. You must specify these parameters if the first device
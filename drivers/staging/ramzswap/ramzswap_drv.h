@@ -17,6 +17,8 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/wait.h>
+#include <linux/crypto.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -38,6 +40,7 @@ struct zobj_header {
 #if 0
 	u32 table_idx;
 #endif
+	u32 hash;	/* hash of uncompressed content, for dedup */
 };
 
 /*-- Configurable parameters */
@@ -46,6 +49,12 @@ struct zobj_header {
 static const unsigned default_disksize_perc_ram = 25;
 static const unsigned default_memlimit_perc_ram = 15;
 
+/*
+ * Default compressor. LZO is called directly; any other name is
+ * looked up through the crypto compression API.
+ */
+static const char default_compressor[] = "lzo";
+
 /*
  * Max compressed page size when backing device is provided.
  * Pages that compress to size greater than this are sent to
@@ -60,6 +69,12 @@ static const unsigned max_zpage_size_bdev = PAGE_SIZE / 2;
  */
 static const unsigned max_zpage_size_nobdev = PAGE_SIZE / 4 * 3;
 
+/*
+ * Number of buckets (as a power of 2) in the per-device index
+ * of stored objects, used to find duplicate pages.
+ */
+#define RZS_DEDUP_HASH_BITS	12
+
 /*
  * NOTE: max_zpage_size_{bdev,nobdev} sizes must be
  * less than or equal to:
@@ -82,6 +97,9 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Compressed object is in the dedup index */
+	RZS_DEDUP,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
@@ -98,6 +116,19 @@ struct table {
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/*
+ * Entry in the dedup index, one per stored compressed object that
+ * can be shared. refcount is the number of table entries pointing
+ * to the object.
+ */
+struct rzs_dedup_entry {
+	struct hlist_node node;
+	struct page *page;
+	u16 offset;
+	u32 hash;
+	u32 refcount;
+};
+
 /*
  * Swap extent information in case backing swap is a regular
  * file. These extent entries must fit exactly in a page.
@@ -107,6 +138,19 @@ struct ramzswap_backing_extent {
 	pgoff_t num_pages;
 } __attribute__((aligned(4)));
 
+/*
+ * Compression stream: LZO working memory (or a crypto_comp transform
+ * for other compressors) plus a buffer large enough to hold the worst
+ * case output for one page. Each device keeps a pool of these so that
+ * several pages can be compressed in parallel.
+ */
+struct ramzswap_comp_stream {
+	void *workmem;
+	struct crypto_comp *tfm;	/* NULL for built-in LZO */
+	void *buffer;
+	struct list_head list;
+};
+
 struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
@@ -120,21 +164,37 @@ struct ramzswap_stats {
 	u64 invalid_io;		/* non-swap I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 stream_waits;	/* no. of times no idle stream was left */
+	u64 num_compr;		/* no. of pages run through compressor */
+	u64 num_decompr;	/* no. of pages run through decompressor */
+	u64 compr_ns;		/* time spent compressing */
+	u64 decompr_ns;		/* time spent decompressing */
 #endif
 };
 
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
+	/*
+	 * Protects mem_pool allocations and table updates. Compression
+	 * itself is done outside this lock using one of the idle streams.
+	 */
 	struct mutex lock;
+	spinlock_t stream_lock;	/* protects idle_streams */
+	struct list_head idle_streams;
+	wait_queue_head_t stream_wait;
+	unsigned int num_streams;
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
+	int use_crypto;		/* compressor is not the built-in LZO */
+	spinlock_t dedup_lock;	/* protects dedup_hash and refcounts */
+	struct hlist_head *dedup_hash;
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -189,6 +249,13 @@ static void stat64_dec(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static void stat64_add(struct ramzswap *rzs, u64 *v, u64 val)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + val;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -204,6 +271,7 @@ static u64 stat64_read(struct ramzswap *rzs, u64 *v)
 #define stat_dec(v)
 #define stat64_inc(r, v)
 #define stat64_dec(r, v)
+#define stat64_add(r, v, val)
 #define stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
@@ -16,6 +16,7 @@
 #define _RAMZSWAP_IOCTL_H_
 
 #define MAX_SWAP_NAME_LEN 128
+#define MAX_COMPRESSOR_NAME_LEN 16
 
 struct ramzswap_ioctl_stats {
 	char backing_swap_name[MAX_SWAP_NAME_LEN];
@@ -38,6 +39,15 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 	u64 bdev_num_reads;	/* no. of reads on backing dev */
 	u64 bdev_num_writes;	/* no. of writes on backing dev */
+	u64 stream_waits;	/* no. of writes that waited for an idle
+				 * compression stream */
+	char compressor[MAX_COMPRESSOR_NAME_LEN];
+	u64 num_compr;		/* no. of pages run through compressor */
+	u64 num_decompr;	/* no. of pages run through decompressor */
+	u64 compr_ns;		/* total time spent compressing */
+	u64 decompr_ns;		/* total time spent decompressing */
+	u32 pages_dedup;	/* no. of stored pages that share memory
+				 * with an identical page */
 } __attribute__ ((packed, aligned(4)));
 
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
@@ -46,5 +56,7 @@ struct ramzswap_ioctl_stats {
 #define RZSIO_GET_STATS		_IOR('z', 3, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 4)
 #define RZSIO_RESET		_IO('z', 5)
+#define RZSIO_SET_COMPRESSOR	_IOW('z', 6, \
+					unsigned char[MAX_COMPRESSOR_NAME_LEN])
 
 #endif
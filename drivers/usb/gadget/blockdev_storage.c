@@ -227,9 +227,12 @@
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/kref.h>
+#include <linux/backing-dev.h>
 #include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/limits.h>
 #include <linux/list.h>
+#include <linux/math64.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/pagemap.h>
@@ -606,6 +609,7 @@ struct lun {
 	unsigned int	prevent_medium_removal : 1;
 	unsigned int	registered : 1;
 	unsigned int	info_valid : 1;
+	unsigned int	sense_deferred : 1;
 	
 	u32		sense_data;
 	u32		sense_data_info;
@@ -613,6 +617,18 @@ struct lun {
 	
 	atomic_t pending_bio_count; 
         atomic_t pending_write_count;
+	wait_queue_head_t write_wait;
+
+	/* a write failed after its status was sent, reported on the next
+	 * command as a deferred error */
+	int		write_error;
+	u32		write_error_sector;
+
+	/* read statistics, reported by the stats attribute */
+	u64		read_bytes;
+	u64		read_ns;
+	unsigned long	ahead_hits;
+	unsigned long	ahead_misses;
 
 	struct device	dev;
 };
@@ -629,9 +645,17 @@ static inline struct lun *dev_to_lun(struct device *dev)
 #define EP0_BUFSIZE	256
 #define DELAYED_STATUS	(EP0_BUFSIZE + 999)	// An impossibly large value
 
-/* Number of buffers we will use.  2 is enough for double-buffering */
-#define NUM_BUFFERS		2
+/* Number of buffers we will use.  2 is enough for double-buffering,
+ * the others are for merging the writes and keeping them in flight */
+#define NUM_BUFFERS		16
 #define MSC_MAX_NR_PAGES      16
+/* Number of read-ahead buffers kept in flight ahead of a sequential READ
+ * stream */
+#define MSC_AHEAD_BUFFERS	4
+/* Buffers merged at most into one write, one is kept for the host */
+#define MSC_WRITE_BATCH_MAX	(NUM_BUFFERS - 1)
+/* How long merged writes may wait for the host's next command */
+#define MSC_WRITE_HOLD		(HZ / 50 + 1)
 #define MSC_READ		1
 #define MSC_WRITE             2
 
@@ -664,6 +688,23 @@ struct fsg_buffhd {
 	struct lun                      *currentlun;
 	struct fsg_dev			*fsg;	
 	struct completion 		complete;
+	atomic_t			bio_refs;	/* merged writes */
+};
+
+/* one bio of merged writes, and the buffers it writes from */
+struct msc_write_bio {
+	struct fsg_dev			*fsg;
+	struct lun			*curlun;
+	sector_t			sector;
+	int				nbh;
+	struct fsg_buffhd		*bh[NUM_BUFFERS];
+};
+
+struct msc_ahead {
+	struct fsg_buffhd		bh;
+	loff_t				start;
+	int				len;
+	int				busy;	/* bio still in flight */
 };
 
 enum fsg_state {
@@ -761,11 +802,23 @@ struct fsg_dev {
 	struct lun		*luns;
 	struct lun		*curlun;
 
-	/* read ahead */
-	struct fsg_buffhd	ahead_bh;
-	int			ahead_start;
-	int			ahead_len;
-	int			ahead_valid;
+	/* read ahead: a ring of consecutive buffers starting at ahead_head,
+	 * read asynchronously ahead of the host's READ stream */
+	struct msc_ahead	ahead[MSC_AHEAD_BUFFERS];
+	int			ahead_nbufs;	/* buffers allocated */
+	int			ahead_head;
+	int			ahead_count;	/* buffers in the ring */
+	int			ahead_window;	/* buffers to keep in flight */
+	struct lun		*ahead_lun;
+	loff_t			ahead_pos;	/* where the stream continues */
+	loff_t			ahead_next;	/* next offset to read ahead */
+
+	/* write back: consecutive buffers waiting to be merged into bios */
+	struct fsg_buffhd	*write_batch[MSC_WRITE_BATCH_MAX];
+	int			write_batch_count;
+	struct lun		*write_batch_lun;
+	loff_t			write_batch_start;
+	unsigned int		write_batch_len;
 };
 
 static const int ahead_size = 64 * 1024;
@@ -795,6 +848,7 @@ static struct usb_gadget_driver		fsg_driver;
 
 static void	close_backing_file(struct lun *curlun);
 static void	close_all_backing_files(struct fsg_dev *fsg);
+static int	fsync_sub(struct lun *curlun);
 
 
 /*-------------------------------------------------------------------------*/
@@ -1626,6 +1680,31 @@ static int sleep_thread(struct fsg_dev *fsg)
 	return rc;
 }
 
+/* Same as sleep_thread(), giving up with -ETIMEDOUT after timeout jiffies */
+static int sleep_thread_timeout(struct fsg_dev *fsg, long timeout)
+{
+	int	rc = 0;
+
+	for (;;) {
+		try_to_freeze();
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (signal_pending(current)) {
+			rc = -EINTR;
+			break;
+		}
+		if (fsg->thread_wakeup_needed)
+			break;
+		if (timeout <= 0) {
+			rc = -ETIMEDOUT;
+			break;
+		}
+		timeout = schedule_timeout(timeout);
+	}
+	__set_current_state(TASK_RUNNING);
+	fsg->thread_wakeup_needed = 0;
+	return rc;
+}
+
 
 /*-------------------------------------------------------------------------*/
 static void msc_bio_read_req_complete(struct bio *bio, int error)
@@ -1634,6 +1713,10 @@ static void msc_bio_read_req_complete(struct bio *bio, int error)
 	unsigned int bytes_done = bh->amount-bio->bi_size;
 	
 	atomic_dec(&bh->currentlun->pending_bio_count); 
+
+	/* don't hand out the data of a failed read */
+	if (error)
+		bytes_done = 0;
    
 	bh->amount = bytes_done;
 	if(bh->ppos)
@@ -1654,7 +1737,8 @@ static void msc_bio_write_req_complete(struct bio *bio, int error)
 	unsigned int bytes_done = bh->amount-bio->bi_size;
 	
 	atomic_dec(&bh->currentlun->pending_bio_count); 
-	atomic_dec(&bh->currentlun->pending_write_count);
+	if (atomic_dec_and_test(&bh->currentlun->pending_write_count))
+		wake_up(&bh->currentlun->write_wait);
    
 	bh->amount = bytes_done;
 	if(bh->ppos)
@@ -1681,9 +1765,6 @@ static ssize_t wait_for_bio_completion(struct fsg_buffhd *bh)
 { 
 	wait_for_completion(&bh->complete);
 
-	if(atomic_read(&bh->currentlun->pending_bio_count) > 0) 
-		printk("Possible error. Completion signalled immediately \n");
-     
 	return (ssize_t)(bh->amount);        
 }        
 
@@ -1703,9 +1784,9 @@ static ssize_t msc_device_req(unsigned int rw, struct fsg_buffhd *bh,
 	int i;
 	ssize_t nrBytes = 0;   
 
-	/* prepare a structure for requests that want to wait for completion */
-	if (wait)
-		init_completion(&bh->complete);
+	/* prepare a structure for requests that want to wait for completion,
+	 * now or later on (read ahead) */
+	init_completion(&bh->complete);
 
  	/* calculate the number of bio submissions */
  	nPages    = len / PAGE_SIZE;
@@ -1715,8 +1796,12 @@ static ssize_t msc_device_req(unsigned int rw, struct fsg_buffhd *bh,
          
  	/* allocate memory for bio */
  	bio = bio_alloc(GFP_NOIO, nPages);
- 	if(bio == NULL)
+ 	if(bio == NULL) {
+		/* let a later waiter see the failed request */
+		bh->amount = 0;
+		complete(&bh->complete);
 		return nrBytes;       
+	}
  
 	/* fill in the physical and number of hardware segments */       
 	bio->bi_sector = (sector_t)((*ppos) / SECTOR_SIZE);
@@ -1770,73 +1855,349 @@ static ssize_t msc_device_req(unsigned int rw, struct fsg_buffhd *bh,
 	return nrBytes;
 } 
 
+static void msc_bio_batch_write_complete(struct bio *bio, int error)
+{
+	struct msc_write_bio *wb = (struct msc_write_bio *)bio->bi_private;
+	struct lun *curlun = wb->curlun;
+	int i;
+
+	/* the host already has its status, keep the error for later */
+	if (error || bio->bi_size) {
+		curlun->write_error_sector = wb->sector;
+		smp_wmb();
+		curlun->write_error = 1;
+	}
+
+	for (i = 0; i < wb->nbh; i++) {
+		struct fsg_buffhd *bh = wb->bh[i];
+
+		if (atomic_dec_and_test(&bh->bio_refs))
+			bh->state = BUF_STATE_EMPTY;
+	}
+
+	atomic_dec(&curlun->pending_bio_count);
+	if (atomic_dec_and_test(&curlun->pending_write_count))
+		wake_up(&curlun->write_wait);
+
+	MDBG("BIO BATCH WRITE COMPLETE: sector %llu, error = %d\n",
+		(unsigned long long)wb->sector, error);
+
+	bio_put(bio);
+	wakeup_thread(wb->fsg);
+	kfree(wb);
+}
+
+static void msc_write_submit(struct bio *bio, struct msc_write_bio *wb)
+{
+	atomic_inc(&wb->curlun->pending_bio_count);
+	atomic_inc(&wb->curlun->pending_write_count);
+	submit_bio(WRITE, bio);
+}
+
+/* start a bio of merged writes at @pos, waiting for memory if need be */
+static struct bio *msc_write_bio_alloc(struct fsg_dev *fsg, loff_t pos,
+		unsigned int len, struct msc_write_bio **pwb)
+{
+	struct lun *curlun = fsg->write_batch_lun;
+	struct msc_write_bio *wb;
+	struct bio *bio;
+	int nr_pages = min_t(int, (len + PAGE_SIZE - 1) >> PAGE_SHIFT,
+			BIO_MAX_PAGES);
+
+	while ((wb = kzalloc(sizeof(*wb), GFP_NOIO)) == NULL)
+		congestion_wait(WRITE, HZ / 50);
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+
+	wb->fsg = fsg;
+	wb->curlun = curlun;
+	wb->sector = (sector_t)(pos >> 9);
+
+	bio->bi_sector = wb->sector;
+	bio->bi_bdev = curlun->filp->f_mapping->host->i_bdev;
+	bio->bi_end_io = msc_bio_batch_write_complete;
+	bio->bi_private = (void *)wb;
+
+	*pwb = wb;
+	return bio;
+}
+
+/*
+ * Write the batch out: its buffers are consecutive on the media, so they go
+ * out in as few bios as the queue limits allow.  The buffers stay dirty
+ * until the last bio using them completes.
+ */
+static void msc_write_flush(struct fsg_dev *fsg)
+{
+	struct msc_write_bio *wb = NULL;
+	struct bio *bio = NULL;
+	loff_t pos = fsg->write_batch_start;
+	unsigned int left_in_batch = fsg->write_batch_len;
+	int i;
+
+	if (!fsg->write_batch_count)
+		return;
+
+	VLDBG(fsg->write_batch_lun, "write back %u @ %llu (%d buffers)\n",
+			fsg->write_batch_len,
+			(unsigned long long)fsg->write_batch_start,
+			fsg->write_batch_count);
+
+	for (i = 0; i < fsg->write_batch_count; i++) {
+		struct fsg_buffhd *bh = fsg->write_batch[i];
+		unsigned int left = bh->amount;
+		int page;
+
+		/* our own reference, until all the bios are out */
+		atomic_set(&bh->bio_refs, 1);
+
+		for (page = 0; left; page++) {
+			unsigned int len = min_t(unsigned int, left, PAGE_SIZE);
+
+			if (!bio || wb->nbh == NUM_BUFFERS
+					|| !bio_add_page(bio, bh->pDataPage[page], len, 0)) {
+				if (bio)
+					msc_write_submit(bio, wb);
+				bio = msc_write_bio_alloc(fsg, pos, left_in_batch, &wb);
+				/* an empty bio always takes a page, a short
+				 * write here would lose the rest of bh */
+				BUG_ON(!bio_add_page(bio, bh->pDataPage[page],
+						len, 0));
+			}
+			if (!wb->nbh || wb->bh[wb->nbh - 1] != bh) {
+				atomic_inc(&bh->bio_refs);
+				wb->bh[wb->nbh++] = bh;
+			}
+			left -= len;
+			left_in_batch -= len;
+			pos += len;
+		}
+	}
+	if (bio)
+		msc_write_submit(bio, wb);
+
+	for (i = 0; i < fsg->write_batch_count; i++) {
+		struct fsg_buffhd *bh = fsg->write_batch[i];
+
+		if (atomic_dec_and_test(&bh->bio_refs))
+			bh->state = BUF_STATE_EMPTY;
+	}
+	fsg->write_batch_count = 0;
+	fsg->write_batch_len = 0;
+}
+
+/* Add a buffer received from the host to the write batch.  The batch is
+ * written out when the data isn't consecutive, when it is full, or when
+ * the host needs one of its buffers. */
+static ssize_t msc_write_queue(struct fsg_dev *fsg, struct fsg_buffhd *bh,
+		loff_t file_offset)
+{
+	struct lun *curlun = bh->currentlun;
+
+	if (fsg->write_batch_count && (fsg->write_batch_lun != curlun
+			|| fsg->write_batch_start + fsg->write_batch_len != file_offset
+			|| fsg->write_batch_count == MSC_WRITE_BATCH_MAX))
+		msc_write_flush(fsg);
+
+	if (!fsg->write_batch_count) {
+		fsg->write_batch_lun = curlun;
+		fsg->write_batch_start = file_offset;
+	}
+	fsg->write_batch[fsg->write_batch_count++] = bh;
+	fsg->write_batch_len += bh->amount;
+
+	if (fsg->next_buffhd_to_fill == fsg->write_batch[0])
+		msc_write_flush(fsg);
+
+	return bh->amount;
+}
+
+/* Make sure @bh isn't held back in the write batch.  Unlike the functions
+ * above, this one is called without the filesem held. */
+static void msc_write_release(struct fsg_dev *fsg, struct fsg_buffhd *bh)
+{
+	if (fsg->write_batch_count && bh == fsg->write_batch[0]) {
+		down_read(&fsg->filesem);
+		msc_write_flush(fsg);
+		up_read(&fsg->filesem);
+	}
+}
+
+/* wait for the read ahead in flight in @ra, if any */
+static void msc_ahead_wait(struct msc_ahead *ra)
+{
+	if (ra->busy) {
+		ra->len = wait_for_bio_completion(&ra->bh);
+		ra->busy = 0;
+	}
+}
+
+/* drop the read-ahead ring, it is invalid after a write or a media change */
+static void msc_ahead_reset(struct fsg_dev *fsg)
+{
+	int i;
+
+	for (i = 0; i < fsg->ahead_nbufs; i++)
+		msc_ahead_wait(&fsg->ahead[i]);
+
+	fsg->ahead_head = 0;
+	fsg->ahead_count = 0;
+	fsg->ahead_lun = NULL;
+}
+
+/* keep ahead_window buffers of the stream queued to the block layer */
+static void msc_ahead_fill(struct fsg_dev *fsg, struct lun *curlun)
+{
+	while (fsg->ahead_count < fsg->ahead_window
+			&& fsg->ahead_next < curlun->file_length) {
+		int slot = (fsg->ahead_head + fsg->ahead_count) % fsg->ahead_nbufs;
+		struct msc_ahead *ra = &fsg->ahead[slot];
+		loff_t offset_tmp = fsg->ahead_next;
+
+		ra->start = fsg->ahead_next;
+		ra->len = min((loff_t)mod_data.buflen,
+				curlun->file_length - fsg->ahead_next);
+		ra->bh.currentlun = curlun;
+		ra->bh.ppos = &offset_tmp;
+		ra->bh.amount = ra->len;
+		ra->busy = 1;
+
+		VDBG(fsg, "ahead   read %10u @ %10llu\n", ra->len,
+				(unsigned long long)ra->start);
+
+		msc_device_req(MSC_READ, &ra->bh, 0);
+
+		fsg->ahead_next += ra->len;
+		fsg->ahead_count++;
+	}
+}
+
+/* read synchronously into an emptied ring, when reading ahead failed */
+static ssize_t msc_ahead_read(struct fsg_dev *fsg, struct lun *curlun,
+		loff_t file_offset)
+{
+	struct msc_ahead *ra = &fsg->ahead[0];
+	loff_t offset_tmp = file_offset;
+
+	ra->start = file_offset;
+	ra->bh.currentlun = curlun;
+	ra->bh.ppos = &offset_tmp;
+	ra->bh.amount = min((loff_t)mod_data.buflen,
+			curlun->file_length - file_offset);
+	ra->busy = 0;
+	ra->len = msc_device_req(MSC_READ, &ra->bh, 1);
+	if (ra->len <= 0) {
+		ERROR(fsg, "error in file read: %d\n", ra->len);
+		return ra->len;
+	}
+
+	fsg->ahead_head = 0;
+	fsg->ahead_count = 1;
+	fsg->ahead_next = file_offset + ra->len;
+	return ra->len;
+}
+
+/* hand the pages of a read-ahead buffer over to the USB request */
+static void msc_swap_buffers(struct fsg_buffhd *bh, struct fsg_buffhd *ahead)
+{
+	int i;
+
+	swap(bh->buf, ahead->buf);
+	for (i = 0; i < MSC_MAX_NR_PAGES; i++)
+		swap(bh->pDataPage[i], ahead->pDataPage[i]);
+
+	bh->inreq->buf = bh->outreq->buf = bh->buf;
+}
+
 static ssize_t msc_cached_read(struct fsg_dev *fsg, struct fsg_buffhd *bh)
 {
 	struct lun *curlun = bh->currentlun;
 	unsigned int amount = bh->amount;
 	loff_t file_offset = *bh->ppos;
 	ssize_t total = 0;
+	int waited = 0;
 	
 	/* no ahead buffer, try to read directly but memory is tight! */
-	if (!fsg->ahead_bh.buf)
+	if (!fsg->ahead_nbufs)
 		return msc_device_req(MSC_READ, bh, 1);
 	
-	if (fsg->ahead_valid && fsg->ahead_bh.currentlun != curlun)
-		fsg->ahead_valid = 0;
+	/* not the continuation of the stream: read directly and don't
+	 * read ahead until the host proves to be streaming */
+	if (fsg->ahead_lun != curlun || fsg->ahead_pos != file_offset) {
+		msc_ahead_reset(fsg);
+		curlun->ahead_misses++;
+
+		total = msc_device_req(MSC_READ, bh, 1);
+
+		fsg->ahead_lun = curlun;
+		fsg->ahead_window = 0;
+		fsg->ahead_pos = fsg->ahead_next =
+				file_offset + max(total, (ssize_t)0);
+		return total;
+	}
+
+	if (!fsg->ahead_window)
+		fsg->ahead_window = 1;
+	msc_ahead_fill(fsg, curlun);
 	
 	while (total < amount) {
-		ssize_t nread;
+		struct msc_ahead *ra;
+		int nread;
 		int buff_offset;
 		
-		/* check if the request is outside of our ahead buffer */
-		if( !fsg->ahead_valid
-				|| (file_offset < fsg->ahead_start)
-				|| (file_offset >= (fsg->ahead_start + fsg->ahead_len)) ) 
-		{
-			loff_t offset_tmp = file_offset;
-			int to_read = min((loff_t)mod_data.buflen, 
-					curlun->file_length - file_offset);
-			int bytes;
-	
-			if (to_read == amount-total) {
-				/* bypass the cache, read directly */
-				return msc_device_req(MSC_READ, bh, 1);
-			}
-			
-			fsg->ahead_bh.currentlun = curlun;
-			fsg->ahead_bh.ppos = &offset_tmp;
-			fsg->ahead_bh.amount = to_read;
-	
-			bytes = msc_device_req(MSC_READ, &fsg->ahead_bh, 1);
-	
-			VDBG(fsg, "hdd     read %10u @ %10llu -> %i\n", 
-					to_read, (unsigned long long)file_offset,
-					bytes);
-	
-			if (bytes < 0) {
-				ERROR(fsg, "error in file read: %d\n", (int)bytes);
-				break;
-			}
-	
-			fsg->ahead_start = file_offset;
-			fsg->ahead_len   = bytes;
-			fsg->ahead_valid = 1;
+		if (!fsg->ahead_count
+				&& msc_ahead_read(fsg, curlun, file_offset) <= 0)
+			break;
+
+		ra = &fsg->ahead[fsg->ahead_head];
+		if (ra->busy) {
+			waited = 1;
+			msc_ahead_wait(ra);
 		}
-		
+
 		/* check offset of file_offset in our buffer */
-		buff_offset = file_offset - fsg->ahead_start;
+		buff_offset = file_offset - ra->start;
+		if (buff_offset >= ra->len) {
+			/* short or failed read ahead, retry synchronously */
+			msc_ahead_reset(fsg);
+			if (msc_ahead_read(fsg, curlun, file_offset) <= 0)
+				break;
+			continue;
+		}
+
 		/* copy only is what is left in our buffer */
-		nread = min((int)amount-total, fsg->ahead_len - buff_offset);
+		nread = min((int)(amount - total), ra->len - buff_offset);
 		
 		VDBG(fsg, "buff    read %10u @ %10llu -> %10d (avail %6d @ %6d)\n", 
-				amount-total, (unsigned long long)file_offset, 
-				nread, fsg->ahead_len, buff_offset);
-	
-		memcpy(bh->buf+total, ((char*)fsg->ahead_bh.buf) + buff_offset, nread);
+				amount - (unsigned int)total,
+				(unsigned long long)file_offset,
+				nread, ra->len, buff_offset);
+
+		if (nread == amount && nread == ra->len)
+			msc_swap_buffers(bh, &ra->bh);
+		else
+			memcpy(bh->buf + total, ((char *)ra->bh.buf) + buff_offset,
+					nread);
 	
 		file_offset += nread;
 		total += nread;
+
+		/* recycle the buffer once it is consumed */
+		if (buff_offset + nread == ra->len) {
+			fsg->ahead_head = (fsg->ahead_head + 1) % fsg->ahead_nbufs;
+			fsg->ahead_count--;
+		}
 	}
+
+	/* the host caught up with the read ahead, widen the window */
+	if (waited) {
+		curlun->ahead_misses++;
+		fsg->ahead_window = min(fsg->ahead_window * 2, fsg->ahead_nbufs);
+	} else
+		curlun->ahead_hits++;
+
+	fsg->ahead_lun = curlun;
+	fsg->ahead_pos = file_offset;
+	msc_ahead_fill(fsg, curlun);
 	
 	if (bh->ppos)
 		*bh->ppos += total;
@@ -1858,6 +2219,7 @@ static int do_read(struct fsg_dev *fsg)
 	unsigned int		partial_page;
 #endif
 	ssize_t			nread;
+	ktime_t			start;
 
 	/* Get the starting Logical Block Address and check that it's
 	 * not too big */
@@ -1893,6 +2255,8 @@ static int do_read(struct fsg_dev *fsg)
 	if (unlikely(amount_left == 0))
 		return -EIO;		// No default reply
 
+	start = ktime_get();
+
 	for (;;) {
 
 		/*
@@ -1938,11 +2302,8 @@ static int do_read(struct fsg_dev *fsg)
 		}		
 
 		/* Perform the read only after committing all the writes */
-		while(atomic_read(&bh->currentlun->pending_write_count) > 0) {
-			VLDBG(curlun, "Waiting on pending writes %d", 
-				atomic_read(&bh->currentlun->pending_write_count));
-			schedule();
-		}
+		wait_event(curlun->write_wait,
+			atomic_read(&curlun->pending_write_count) == 0);
 		
 		/* perform the read - synchronous call*/
 		file_offset_tmp = file_offset;
@@ -1987,6 +2348,9 @@ static int do_read(struct fsg_dev *fsg)
 		fsg->next_buffhd_to_fill = bh->next;
 	}
 
+	curlun->read_bytes += fsg->data_size_from_cmnd - amount_left;
+	curlun->read_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
 	return -EIO;		// No default reply
 }
 
@@ -2081,7 +2445,7 @@ static int do_write(struct fsg_dev *fsg)
 	struct fsg_buffhd	*bh;
 	int			get_some_more;
 	u32			amount_left_to_req, amount_left_to_write;
-	loff_t			usb_offset, file_offset, file_offset_tmp;
+	loff_t			usb_offset, file_offset;
 	unsigned int		amount;
 #if 0
 	unsigned int		partial_page;
@@ -2096,7 +2460,7 @@ static int do_write(struct fsg_dev *fsg)
 	curlun->filp->f_flags &= ~O_SYNC;	// Default is not to wait
 
 	/* force rereading the drive again */
-	fsg->ahead_valid = 0;
+	msc_ahead_reset(fsg);
 
 	/* Get the starting Logical Block Address and check that it's
 	 * not too big */
@@ -2222,15 +2586,13 @@ static int do_write(struct fsg_dev *fsg)
 				amount = curlun->file_length - file_offset;
 			}
 
-			/* Perform the write */
-			file_offset_tmp = file_offset;
-			
-			/* Perform the write */
-			bh->ppos = &file_offset_tmp;
+			/* Perform the write, in the background: a failure
+			 * is reported on the next command */
+			bh->ppos = NULL;
 			bh->amount = amount;
 			bh->state = BUF_STATE_DIRTY;
 			
-            		nwritten = msc_device_req(MSC_WRITE, bh, 0);
+            		nwritten = msc_write_queue(fsg, bh, file_offset);
 			VLDBG(curlun, "file write %u @ %llu -> %d\n", amount,
 					(unsigned long long) file_offset,
 					(int) nwritten);		
@@ -2295,6 +2657,13 @@ static int do_write(struct fsg_dev *fsg)
 			return rc;
 	}
 
+	/* FUA: the data must be on the media before the status goes out */
+	if ((curlun->filp->f_flags & O_SYNC) && fsync_sub(curlun)) {
+		curlun->sense_data = SS_WRITE_ERROR;
+		curlun->sense_data_info = file_offset / SECTOR_SIZE;
+		curlun->info_valid = 1;
+	}
+
 	return -EIO;		// No default reply
 }
 
@@ -2331,13 +2700,17 @@ static int fsync_sub(struct lun *curlun)
 	return rc;
 #endif
 
-	while(atomic_read(&curlun->pending_write_count) > 0)
-	{
-		VLDBG(curlun, "Waiting on pending writes %d", 
-			atomic_read(&curlun->pending_write_count));
-		schedule();
+	if (the_fsg && the_fsg->write_batch_lun == curlun)
+		msc_write_flush(the_fsg);
+
+	wait_event(curlun->write_wait,
+		atomic_read(&curlun->pending_write_count) == 0);
+
+	/* a failed write is reported here, not as a deferred error */
+	if (curlun->write_error) {
+		curlun->write_error = 0;
+		return -EIO;
 	}
-	
 	return 0;
 }
 
@@ -2545,13 +2918,16 @@ static int do_request_sense(struct fsg_dev *fsg, struct fsg_buffhd *bh)
 		sd = curlun->sense_data;
 		sdinfo = curlun->sense_data_info;
 		valid = curlun->info_valid << 7;
+		if (curlun->sense_deferred)
+			valid |= 0x01;		// Deferred error
 		curlun->sense_data = SS_NO_SENSE;
 		curlun->sense_data_info = 0;
 		curlun->info_valid = 0;
+		curlun->sense_deferred = 0;
 	}
 
 	memset(buf, 0, 18);
-	buf[0] = valid | 0x70;			// Valid, current error
+	buf[0] = valid | 0x70;			// Valid, current/deferred error
 	buf[2] = SK(sd);
 	put_be32(&buf[3], sdinfo);		// Sense information
 	buf[7] = 18 - 8;			// Additional sense length
@@ -3166,6 +3542,7 @@ static int check_command(struct fsg_dev *fsg, int cmnd_size,
 			curlun->sense_data = SS_NO_SENSE;
 			curlun->sense_data_info = 0;
 			curlun->info_valid = 0;
+			curlun->sense_deferred = 0;
 		}
 	} else {
 		fsg->curlun = curlun = NULL;
@@ -3190,6 +3567,20 @@ static int check_command(struct fsg_dev *fsg, int cmnd_size,
 		return -EINVAL;
 	}
 
+	/* A write that failed after its status was sent fails the next
+	 * command, as a deferred error. */
+	if (curlun && curlun->write_error &&
+			fsg->cmnd[0] != SC_INQUIRY &&
+			fsg->cmnd[0] != SC_REQUEST_SENSE) {
+		curlun->write_error = 0;
+		smp_rmb();
+		curlun->sense_data = SS_WRITE_ERROR;
+		curlun->sense_data_info = curlun->write_error_sector;
+		curlun->info_valid = 1;
+		curlun->sense_deferred = 1;
+		return -EINVAL;
+	}
+
 	/* Check that only command bytes listed in the mask are non-zero */
 	fsg->cmnd[1] &= 0x1f;			// Mask away the LUN
 	for (i = 1; i < cmnd_size; ++i) {
@@ -3223,6 +3614,7 @@ static int do_scsi_command(struct fsg_dev *fsg)
 
 	/* Wait for the next buffer to become available for data or status */
 	bh = fsg->next_buffhd_to_drain = fsg->next_buffhd_to_fill;
+	msc_write_release(fsg, bh);
 	while (bh->state != BUF_STATE_EMPTY) {
 		rc = sleep_thread(fsg);
 		if (rc)
@@ -3232,6 +3624,12 @@ static int do_scsi_command(struct fsg_dev *fsg)
 	fsg->short_packet_received = 0;
 
 	down_read(&fsg->filesem);	// We're using the backing file
+
+	/* Only writes can be merged with the write batch */
+	if (fsg->cmnd[0] != SC_WRITE_6 && fsg->cmnd[0] != SC_WRITE_10
+			&& fsg->cmnd[0] != SC_WRITE_12)
+		msc_write_flush(fsg);
+
 	switch (fsg->cmnd[0]) {
 
 	case SC_INQUIRY:
@@ -3502,6 +3900,7 @@ static int get_next_command(struct fsg_dev *fsg)
 
 		/* Wait for the next buffer to become available */
 		bh = fsg->next_buffhd_to_fill;
+		msc_write_release(fsg, bh);
 		while (bh->state != BUF_STATE_EMPTY) {
 			rc = sleep_thread(fsg);
 			if (rc)
@@ -3518,9 +3917,18 @@ static int get_next_command(struct fsg_dev *fsg)
 		 * can reuse it for the next filling.  No need to advance
 		 * next_buffhd_to_fill. */
 
-		/* Wait for the CBW to arrive */
+		/* Wait for the CBW to arrive.  Writes merged so far may
+		 * still grow with the next command, but they are written out
+		 * if the host goes quiet. */
 		while (bh->state != BUF_STATE_FULL) {
-			rc = sleep_thread(fsg);
+			if (fsg->write_batch_count)
+				rc = sleep_thread_timeout(fsg, MSC_WRITE_HOLD);
+			else
+				rc = sleep_thread(fsg);
+			if (rc == -ETIMEDOUT) {
+				msc_write_release(fsg, fsg->write_batch[0]);
+				rc = 0;
+			}
 			if (rc)
 				return rc;
 		}
@@ -3531,6 +3939,8 @@ static int get_next_command(struct fsg_dev *fsg)
 	} else {		// USB_PR_CB or USB_PR_CBI
 
 		/* Wait for the next command to arrive */
+		if (fsg->write_batch_count)
+			msc_write_release(fsg, fsg->write_batch[0]);
 		while (fsg->cbbuf_cmnd_size == 0) {
 			rc = sleep_thread(fsg);
 			if (rc)
@@ -3747,6 +4157,10 @@ static void handle_exception(struct fsg_dev *fsg)
 		}
 	}
 
+	/* Write out what the host already sent us */
+	if (fsg->write_batch_count)
+		msc_write_release(fsg, fsg->write_batch[0]);
+
 	/* Cancel all the pending transfers */
 	if (fsg->intreq_busy)
 		usb_ep_dequeue(fsg->intr_in, fsg->intreq);
@@ -3764,6 +4178,8 @@ static void handle_exception(struct fsg_dev *fsg)
 		for (i = 0; i < NUM_BUFFERS; ++i) {
 			bh = &fsg->buffhds[i];
 			num_active += bh->inreq_busy + bh->outreq_busy;
+			/* don't recycle buffers still being written */
+			num_active += (bh->state == BUF_STATE_DIRTY);
 		}
 		if (num_active == 0)
 			break;
@@ -4068,6 +4484,8 @@ static void close_backing_file(struct lun *curlun)
 {
 	if (curlun->filp) {
 		LDBG(curlun, "close backing file\n");
+		if (the_fsg)
+			msc_ahead_reset(the_fsg);
 		set_queue_unplug_threshold(curlun->filp, 4);
 		fsync_sub(curlun);
 		fput(curlun->filp);
@@ -4179,9 +4597,36 @@ static ssize_t store_file(struct device *dev, struct device_attribute *attr,
 }
 
 
+static ssize_t show_stats(struct device *dev, struct device_attribute *attr,
+		char *buf)
+{
+	struct lun	*curlun = dev_to_lun(dev);
+	struct fsg_dev	*fsg = (struct fsg_dev *) dev_get_drvdata(dev);
+	u64		rate = 0;
+	u32		frac;
+
+	/* MB/s with two decimals, counted over the time spent in READs */
+	if (curlun->read_ns)
+		rate = div64_u64(curlun->read_bytes * 100000, curlun->read_ns);
+	frac = do_div(rate, 100);
+
+	return sprintf(buf, "read_bytes %llu\n"
+			"read_ms %llu\n"
+			"read_rate %llu.%02u MB/s\n"
+			"ahead_hits %lu\n"
+			"ahead_misses %lu\n"
+			"ahead_window %d/%d\n",
+			(unsigned long long)curlun->read_bytes,
+			(unsigned long long)div_u64(curlun->read_ns, NSEC_PER_MSEC),
+			(unsigned long long)rate, frac,
+			curlun->ahead_hits, curlun->ahead_misses,
+			fsg->ahead_window, fsg->ahead_nbufs);
+}
+
 /* The write permissions and store_xxx pointers are set in fsg_bind() */
 static DEVICE_ATTR(ro, 0444, show_ro, NULL);
 static DEVICE_ATTR(file, 0444, show_file, NULL);
+static DEVICE_ATTR(stats, 0444, show_stats, NULL);
 
 
 /*-------------------------------------------------------------------------*/
@@ -4217,6 +4662,7 @@ static void fsg_unbind(struct usb_gadget *gadget)
 		if (curlun->registered) {
 			device_remove_file(&curlun->dev, &dev_attr_ro);
 			device_remove_file(&curlun->dev, &dev_attr_file);
+			device_remove_file(&curlun->dev, &dev_attr_stats);
 			device_unregister(&curlun->dev);
 			curlun->registered = 0;
 		}
@@ -4231,13 +4677,16 @@ static void fsg_unbind(struct usb_gadget *gadget)
 		complete(&fsg->thread_notifier);
 	}
 
-	if( fsg->ahead_bh.buf ){
+	/* Wait for the reads ahead still in flight, then free their buffers */
+	msc_ahead_reset(fsg);
+	for (i = 0; i < fsg->ahead_nbufs; ++i) {
 		int order = get_order(mod_data.buflen);
 
-		free_pages((unsigned long)fsg->ahead_bh.buf,order);
+		free_pages((unsigned long)fsg->ahead[i].bh.buf,order);
 
-		fsg->ahead_bh.buf = NULL;
+		fsg->ahead[i].bh.buf = NULL;
 	}
+	fsg->ahead_nbufs = 0;
 
 	/* Free the data buffers */
 	for (i = 0; i < NUM_BUFFERS; ++i) {
@@ -4409,7 +4858,8 @@ static int __init fsg_bind(struct usb_gadget *gadget)
 		kref_get(&fsg->ref);
 		curlun->dev.release = lun_release;
 		if( device_create_file(&curlun->dev, &dev_attr_ro) 
-				|| device_create_file(&curlun->dev, &dev_attr_file) ){
+				|| device_create_file(&curlun->dev, &dev_attr_file)
+				|| device_create_file(&curlun->dev, &dev_attr_stats) ){
 			device_unregister(&curlun->dev);
 			goto out;
 		}
@@ -4425,6 +4875,7 @@ static int __init fsg_bind(struct usb_gadget *gadget)
 		
 		atomic_set(&curlun->pending_bio_count, 0);
 		atomic_set(&curlun->pending_write_count, 0);
+		init_waitqueue_head(&curlun->write_wait);
 	}
 
 	/* Find all the endpoints we will use */
@@ -4525,20 +4976,24 @@ static int __init fsg_bind(struct usb_gadget *gadget)
 
 	fsg->buffhds[NUM_BUFFERS - 1].next = &fsg->buffhds[0];
 
-	/* read ahead */
+	/* read ahead, use as many buffers as we can get */
 	ERROR(fsg, "allocating read_ahead...\n");
 	order = get_order(mod_data.buflen);
-	dataPage = alloc_pages(GFP_KERNEL, order);
-	if (dataPage) {
-		fsg->ahead_bh.buf = page_address(dataPage);
-		fsg->ahead_bh.fsg = fsg;
+	for (i = 0; i < MSC_AHEAD_BUFFERS; ++i) {
+		struct fsg_buffhd	*bh = &fsg->ahead[i].bh;
+
+		dataPage = alloc_pages(GFP_KERNEL, order);
+		if (!dataPage)
+			break;
+		bh->buf = page_address(dataPage);
+		bh->fsg = fsg;
 		for(tempCount = 0; tempCount < nMscPagesInSingleBuffer; tempCount++)
-			fsg->ahead_bh.pDataPage[tempCount] = dataPage + tempCount;
-		fsg->ahead_bh.next = NULL;
-	} else {
-		ERROR(fsg, "cannot allocate read-ahead buffer, trying without.\n");
-		fsg->ahead_bh.buf = NULL;
+			bh->pDataPage[tempCount] = dataPage + tempCount;
+		bh->next = NULL;
 	}
+	fsg->ahead_nbufs = i;
+	if (!fsg->ahead_nbufs)
+		ERROR(fsg, "cannot allocate read-ahead buffer, trying without.\n");
 	
 	/* This should reflect the actual gadget power source */
 	// MB: we're not self powered
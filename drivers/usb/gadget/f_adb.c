@@ -25,6 +25,8 @@
 #include <linux/wait.h>
 #include <linux/err.h>
 #include <linux/interrupt.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 
 #include <linux/types.h>
 #include <linux/device.h>
@@ -36,11 +38,29 @@
 
 #include "f_adb.h"
 
-#define BULK_BUFFER_SIZE           4096
+/* size of the rx and tx requests, multiples of the bulk maxpacket.
+ * The host sends adb messages without a terminating short packet, so the
+ * rx requests must not be larger than the adb payload size. */
+static unsigned int rx_req_size = 4096;
+module_param_named(adb_rx_size, rx_req_size, uint, S_IRUGO);
+MODULE_PARM_DESC(adb_rx_size, "size of the adb rx requests");
+
+static unsigned int tx_req_size = 16384;
+module_param_named(adb_tx_size, tx_req_size, uint, S_IRUGO);
+MODULE_PARM_DESC(adb_tx_size, "size of the adb tx requests");
 
 /* number of rx and tx requests to allocate */
-#define RX_REQ_MAX 4
-#define TX_REQ_MAX 4
+static unsigned int rx_req_max = 8;
+module_param_named(adb_rx_reqs, rx_req_max, uint, S_IRUGO);
+MODULE_PARM_DESC(adb_rx_reqs, "number of adb rx requests");
+
+static unsigned int tx_req_max = 8;
+module_param_named(adb_tx_reqs, tx_req_max, uint, S_IRUGO);
+MODULE_PARM_DESC(adb_tx_reqs, "number of adb tx requests");
+
+#define ADB_REQ_SIZE_MIN	512
+#define ADB_REQ_SIZE_MAX	65536
+#define ADB_REQ_MAX		64
 
 static const char shortname[] = "android_adb";
 
@@ -70,6 +90,9 @@ struct adb_dev {
 	struct usb_request *read_req;
 	unsigned char *read_buf;
 	unsigned read_count;
+
+	/* the tx request being filled by adb_splice_write() */
+	struct usb_request *splice_req;
 };
 
 static struct usb_interface_descriptor adb_interface_desc = {
@@ -261,17 +284,25 @@ static int __init create_bulk_endpoints(struct adb_dev *dev,
 	DBG(cdev, "usb_ep_autoconfig for adb ep_out got %s\n", ep->name);
 	dev->ep_out = ep;
 
+	/* keep the module parameters sane */
+	rx_req_size = clamp_t(unsigned int, ALIGN(rx_req_size, ADB_REQ_SIZE_MIN),
+			ADB_REQ_SIZE_MIN, ADB_REQ_SIZE_MAX);
+	tx_req_size = clamp_t(unsigned int, ALIGN(tx_req_size, ADB_REQ_SIZE_MIN),
+			ADB_REQ_SIZE_MIN, ADB_REQ_SIZE_MAX);
+	rx_req_max = clamp_t(unsigned int, rx_req_max, 1, ADB_REQ_MAX);
+	tx_req_max = clamp_t(unsigned int, tx_req_max, 1, ADB_REQ_MAX);
+
 	/* now allocate requests for our endpoints */
-	for (i = 0; i < RX_REQ_MAX; i++) {
-		req = adb_request_new(dev->ep_out, BULK_BUFFER_SIZE);
+	for (i = 0; i < rx_req_max; i++) {
+		req = adb_request_new(dev->ep_out, rx_req_size);
 		if (!req)
 			goto fail;
 		req->complete = adb_complete_out;
 		req_put(dev, &dev->rx_idle, req);
 	}
 
-	for (i = 0; i < TX_REQ_MAX; i++) {
-		req = adb_request_new(dev->ep_in, BULK_BUFFER_SIZE);
+	for (i = 0; i < tx_req_max; i++) {
+		req = adb_request_new(dev->ep_in, tx_req_size);
 		if (!req)
 			goto fail;
 		req->complete = adb_complete_in;
@@ -320,7 +351,7 @@ static ssize_t adb_read(struct file *fp, char __user *buf,
 		/* if we have idle read requests, get them queued */
 		while ((req = req_get(dev, &dev->rx_idle))) {
 requeue_req:
-			req->length = BULK_BUFFER_SIZE;
+			req->length = rx_req_size;
 			ret = usb_ep_queue(dev->ep_out, req, GFP_ATOMIC);
 
 			if (ret < 0) {
@@ -419,8 +450,8 @@ static ssize_t adb_write(struct file *fp, const char __user *buf,
 		}
 
 		if (req != 0) {
-			if (count > BULK_BUFFER_SIZE)
-				xfer = BULK_BUFFER_SIZE;
+			if (count > tx_req_size)
+				xfer = tx_req_size;
 			else
 				xfer = count;
 			if (copy_from_user(req->buf, buf, xfer)) {
@@ -453,6 +484,90 @@ static ssize_t adb_write(struct file *fp, const char __user *buf,
 	return r;
 }
 
+/*
+ * Copy a pipe buffer straight into the tx request being filled, queueing it
+ * once full.  Used for splice() and sendfile(), this saves the copy through
+ * user space that read() and write() make.
+ */
+static int adb_pipe_to_req(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct adb_dev *dev = sd->u.file->private_data;
+	struct usb_request *req = dev->splice_req;
+	unsigned int xfer;
+	void *src;
+	int ret;
+
+	if (dev->error)
+		return -EIO;
+
+	ret = buf->ops->confirm(pipe, buf);
+	if (ret)
+		return ret;
+
+	if (!req) {
+		ret = wait_event_interruptible(dev->write_wq,
+			((req = req_get(dev, &dev->tx_idle)) || dev->error));
+		if (req == 0)
+			return ret < 0 ? ret : -EIO;
+		req->length = 0;
+		dev->splice_req = req;
+	}
+
+	xfer = min(sd->len, tx_req_size - req->length);
+	src = buf->ops->map(pipe, buf, 0);
+	memcpy(req->buf + req->length, src + buf->offset, xfer);
+	buf->ops->unmap(pipe, buf, src);
+	req->length += xfer;
+
+	if (req->length == tx_req_size) {
+		dev->splice_req = 0;
+		ret = usb_ep_queue(dev->ep_in, req, GFP_ATOMIC);
+		if (ret < 0) {
+			DBG(dev->cdev, "adb_splice_write: xfer error %d\n", ret);
+			dev->error = 1;
+			req_put(dev, &dev->tx_idle, req);
+			return -EIO;
+		}
+	}
+
+	return xfer;
+}
+
+static ssize_t adb_splice_write(struct pipe_inode_info *pipe, struct file *fp,
+				loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct adb_dev *dev = fp->private_data;
+	struct usb_request *req;
+	ssize_t r;
+
+	DBG(dev->cdev, "adb_splice_write(%zu)\n", len);
+
+	if (_lock(&dev->write_excl))
+		return -EBUSY;
+
+	r = splice_from_pipe(pipe, fp, ppos, len, flags, adb_pipe_to_req);
+
+	/* send what is left over */
+	req = dev->splice_req;
+	dev->splice_req = 0;
+	if (req) {
+		if (r > 0 && !dev->error
+				&& usb_ep_queue(dev->ep_in, req, GFP_ATOMIC) == 0)
+			req = 0;
+		else if (r > 0) {
+			dev->error = 1;
+			r = -EIO;
+		}
+		if (req)
+			req_put(dev, &dev->tx_idle, req);
+	}
+
+	_unlock(&dev->write_excl);
+	DBG(dev->cdev, "adb_splice_write returning %zd\n", r);
+	return r;
+}
+
 static int adb_open(struct inode *ip, struct file *fp)
 {
 	printk(KERN_INFO "adb_open\n");
@@ -479,6 +594,7 @@ static struct file_operations adb_fops = {
 	.owner = THIS_MODULE,
 	.read = adb_read,
 	.write = adb_write,
+	.splice_write = adb_splice_write,
 	.open = adb_open,
 	.release = adb_release,
 };
@@ -347,6 +347,22 @@ static unsigned long archos_dpm_iocount(struct hdd_dpm_ops *dpm_ops)
 	return hdd->us->srb == NULL ? hdd->us->io_count : 0;
 }
 
+static struct backing_dev_info *archos_dpm_get_bdi(struct hdd_dpm_ops *dpm_ops)
+{
+	struct archos_hdd *hdd = to_archos_hdd(dpm_ops);
+	struct scsi_device *sdev = hdd->us->sdev;
+	struct scsi_disk *sdkp;
+
+	if (sdev == NULL)
+		return NULL;
+
+	sdkp = dev_get_drvdata(&sdev->sdev_gendev);
+	if (sdkp == NULL || sdkp->disk->queue == NULL)
+		return NULL;
+
+	return &sdkp->disk->queue->backing_dev_info;
+}
+
 /*
  * central power management hook. caller holds us->dev_lock
  */
@@ -369,7 +385,8 @@ static void archos_hdd_pm_hook(struct us_data *us, int state)
 			
 		}
 
-	}
+	} else if (state == US_IO_DONE)
+		hdd_dpm_io_event(dpm_ops);
 }
 
 static int archos_sata_reset( struct us_data *us )
@@ -423,6 +440,7 @@ int archos_hdd_init(struct us_data *us)
 	hdd->dpm_ops.resume   = archos_dpm_resume;
 	hdd->dpm_ops.sync     = archos_dpm_sync;
 	hdd->dpm_ops.get_iocount = archos_dpm_iocount;
+	hdd->dpm_ops.get_bdi  = archos_dpm_get_bdi;
 	hdd->dpm_ops.pm_state = PM_SUSPEND_ON;
 	hdd->dpm_ops.shutdown = 1;
 	hdd->pusb_parent      = us->pusb_dev->parent;
@@ -402,6 +402,10 @@ static int usb_stor_control_thread(void * __us)
 
 		/* do a bit of book keeping */
 		us->io_count++;
+#ifdef CONFIG_PM
+		if (us->suspend_resume_hook)
+			us->suspend_resume_hook(us, US_IO_DONE);
+#endif
 
 		/* lock access to the state */
 		scsi_lock(host);
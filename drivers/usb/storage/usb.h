@@ -98,6 +98,7 @@ typedef int (*dev_reattach)(struct us_data *); 	/* reset device permanently atta
 
 #define US_SUSPEND	0
 #define US_RESUME	1
+#define US_IO_DONE	2
 
 /* we allocate one of these for every device that we remember */
 struct us_data {
@@ -10,13 +10,19 @@
 
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/mm.h>
 #include "fat.h"
 
-/* this must be > 0. */
-#define FAT_MAX_CACHE	8
-
+/*
+ * Each inode keeps the runs of contiguous clusters of its chain found so
+ * far in a tree sorted by file cluster.  All of them are on one global LRU
+ * list, trimmed by a shrinker under memory pressure.
+ */
 struct fat_cache {
-	struct list_head cache_list;
+	struct list_head cache_list;	/* fat_cache_lru */
+	struct rb_node rb_node;		/* ->cache_tree */
+	struct inode *inode;
+	int referenced;	/* looked up since the shrinker last saw it */
 	int nr_contig;	/* number of contiguous clusters */
 	int fcluster;	/* cluster number in the file. */
 	int dcluster;	/* cluster number on disk. */
@@ -29,13 +35,12 @@ struct fat_cache_id {
 	int dcluster;
 };
 
-static inline int fat_max_cache(struct inode *inode)
-{
-	return FAT_MAX_CACHE;
-}
-
 static struct kmem_cache *fat_cache_cachep;
 
+static LIST_HEAD(fat_cache_lru);
+static DEFINE_SPINLOCK(fat_cache_lru_lock);
+static int fat_cache_count;
+
 static void init_once(void *foo)
 {
 	struct fat_cache *cache = (struct fat_cache *)foo;
@@ -43,6 +48,60 @@ static void init_once(void *foo)
 	INIT_LIST_HEAD(&cache->cache_list);
 }
 
+static inline void fat_cache_free(struct fat_cache *cache);
+
+/*
+ * Called with the inode's cache_lru_lock held, drops an extent from the
+ * inode's tree and from the LRU.
+ */
+static void fat_cache_unlink(struct msdos_inode_info *i,
+			     struct fat_cache *cache)
+{
+	rb_erase(&cache->rb_node, &i->cache_tree);
+	i->nr_caches--;
+
+	spin_lock(&fat_cache_lru_lock);
+	list_del_init(&cache->cache_list);
+	fat_cache_count--;
+	spin_unlock(&fat_cache_lru_lock);
+}
+
+static int fat_cache_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+	struct fat_cache *cache;
+	struct msdos_inode_info *i;
+	int ret;
+
+	spin_lock(&fat_cache_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&fat_cache_lru)) {
+		cache = list_first_entry(&fat_cache_lru, struct fat_cache,
+					 cache_list);
+		i = MSDOS_I(cache->inode);
+		/* second chance for extents still in use */
+		if (cache->referenced ||
+		    !spin_trylock(&i->cache_lru_lock)) {
+			cache->referenced = 0;
+			list_move_tail(&cache->cache_list, &fat_cache_lru);
+			continue;
+		}
+		rb_erase(&cache->rb_node, &i->cache_tree);
+		i->nr_caches--;
+		list_del_init(&cache->cache_list);
+		fat_cache_count--;
+		spin_unlock(&i->cache_lru_lock);
+
+		fat_cache_free(cache);
+	}
+	ret = fat_cache_count;
+	spin_unlock(&fat_cache_lru_lock);
+	return ret;
+}
+
+static struct shrinker fat_cache_shrinker = {
+	.shrink = fat_cache_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 int __init fat_cache_init(void)
 {
 	fat_cache_cachep = kmem_cache_create("fat_cache",
@@ -51,11 +110,13 @@ int __init fat_cache_init(void)
 				init_once);
 	if (fat_cache_cachep == NULL)
 		return -ENOMEM;
+	register_shrinker(&fat_cache_shrinker);
 	return 0;
 }
 
 void fat_cache_destroy(void)
 {
+	unregister_shrinker(&fat_cache_shrinker);
 	kmem_cache_destroy(fat_cache_cachep);
 }
 
@@ -70,39 +131,36 @@ static inline void fat_cache_free(struct fat_cache *cache)
 	kmem_cache_free(fat_cache_cachep, cache);
 }
 
-static inline void fat_cache_update_lru(struct inode *inode,
-					struct fat_cache *cache)
-{
-	if (MSDOS_I(inode)->cache_lru.next != &cache->cache_list)
-		list_move(&cache->cache_list, &MSDOS_I(inode)->cache_lru);
-}
-
 static int fat_cache_lookup(struct inode *inode, int fclus,
 			    struct fat_cache_id *cid,
 			    int *cached_fclus, int *cached_dclus)
 {
-	static struct fat_cache nohit = { .fcluster = 0, };
-
-	struct fat_cache *hit = &nohit, *p;
+	struct rb_node *n;
+	struct fat_cache *hit = NULL, *p;
 	int offset = -1;
 
 	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	list_for_each_entry(p, &MSDOS_I(inode)->cache_lru, cache_list) {
+	cid->id = MSDOS_I(inode)->cache_valid_id;
+	n = MSDOS_I(inode)->cache_tree.rb_node;
+	while (n) {
 		/* Find the cache of "fclus" or nearest cache. */
-		if (p->fcluster <= fclus && hit->fcluster < p->fcluster) {
+		p = rb_entry(n, struct fat_cache, rb_node);
+		if (p->fcluster > fclus)
+			n = n->rb_left;
+		else {
 			hit = p;
-			if ((hit->fcluster + hit->nr_contig) < fclus) {
-				offset = hit->nr_contig;
-			} else {
-				offset = fclus - hit->fcluster;
+			if (p->fcluster == fclus)
 				break;
-			}
+			n = n->rb_right;
 		}
 	}
-	if (hit != &nohit) {
-		fat_cache_update_lru(inode, hit);
+	if (hit != NULL) {
+		if ((hit->fcluster + hit->nr_contig) < fclus)
+			offset = hit->nr_contig;
+		else
+			offset = fclus - hit->fcluster;
+		hit->referenced = 1;
 
-		cid->id = MSDOS_I(inode)->cache_valid_id;
 		cid->nr_contig = hit->nr_contig;
 		cid->fcluster = hit->fcluster;
 		cid->dcluster = hit->dcluster;
@@ -114,77 +172,89 @@ static int fat_cache_lookup(struct inode *inode, int fclus,
 	return offset;
 }
 
+/*
+ * Find the same part as "new" in cluster-chain, or the place to insert it
+ * in the tree.
+ */
 static struct fat_cache *fat_cache_merge(struct inode *inode,
-					 struct fat_cache_id *new)
+					 struct fat_cache_id *new,
+					 struct rb_node ***pp,
+					 struct rb_node **pparent)
 {
-	struct fat_cache *p;
-
-	list_for_each_entry(p, &MSDOS_I(inode)->cache_lru, cache_list) {
-		/* Find the same part as "new" in cluster-chain. */
-		if (p->fcluster == new->fcluster) {
-			BUG_ON(p->dcluster != new->dcluster);
-			if (new->nr_contig > p->nr_contig)
-				p->nr_contig = new->nr_contig;
-			return p;
+	struct rb_node **p = &MSDOS_I(inode)->cache_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct fat_cache *cache;
+
+	while (*p) {
+		parent = *p;
+		cache = rb_entry(parent, struct fat_cache, rb_node);
+		if (new->fcluster < cache->fcluster)
+			p = &parent->rb_left;
+		else if (new->fcluster > cache->fcluster)
+			p = &parent->rb_right;
+		else {
+			BUG_ON(cache->dcluster != new->dcluster);
+			if (new->nr_contig > cache->nr_contig)
+				cache->nr_contig = new->nr_contig;
+			cache->referenced = 1;
+			return cache;
 		}
 	}
+	*pp = p;
+	*pparent = parent;
 	return NULL;
 }
 
 static void fat_cache_add(struct inode *inode, struct fat_cache_id *new)
 {
-	struct fat_cache *cache, *tmp;
-
-	if (new->fcluster == -1) /* dummy cache */
-		return;
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_cache *cache;
+	struct rb_node **p, *parent;
 
-	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	if (new->id != FAT_CACHE_VALID &&
-	    new->id != MSDOS_I(inode)->cache_valid_id)
+	spin_lock(&i->cache_lru_lock);
+	if (new->id != FAT_CACHE_VALID && new->id != i->cache_valid_id)
 		goto out;	/* this cache was invalidated */
+	if (fat_cache_merge(inode, new, &p, &parent))
+		goto out;
+	spin_unlock(&i->cache_lru_lock);
 
-	cache = fat_cache_merge(inode, new);
-	if (cache == NULL) {
-		if (MSDOS_I(inode)->nr_caches < fat_max_cache(inode)) {
-			MSDOS_I(inode)->nr_caches++;
-			spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
-
-			tmp = fat_cache_alloc(inode);
-			spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-			cache = fat_cache_merge(inode, new);
-			if (cache != NULL) {
-				MSDOS_I(inode)->nr_caches--;
-				fat_cache_free(tmp);
-				goto out_update_lru;
-			}
-			cache = tmp;
-		} else {
-			struct list_head *p = MSDOS_I(inode)->cache_lru.prev;
-			cache = list_entry(p, struct fat_cache, cache_list);
-		}
-		cache->fcluster = new->fcluster;
-		cache->dcluster = new->dcluster;
-		cache->nr_contig = new->nr_contig;
+	cache = fat_cache_alloc(inode);
+	if (cache == NULL)
+		return;
+
+	spin_lock(&i->cache_lru_lock);
+	if ((new->id != FAT_CACHE_VALID && new->id != i->cache_valid_id) ||
+	    fat_cache_merge(inode, new, &p, &parent)) {
+		spin_unlock(&i->cache_lru_lock);
+		fat_cache_free(cache);
+		return;
 	}
-out_update_lru:
-	fat_cache_update_lru(inode, cache);
+	cache->inode = inode;
+	cache->referenced = 0;
+	cache->fcluster = new->fcluster;
+	cache->dcluster = new->dcluster;
+	cache->nr_contig = new->nr_contig;
+	rb_link_node(&cache->rb_node, parent, p);
+	rb_insert_color(&cache->rb_node, &i->cache_tree);
+	i->nr_caches++;
+
+	spin_lock(&fat_cache_lru_lock);
+	list_add_tail(&cache->cache_list, &fat_cache_lru);
+	fat_cache_count++;
+	spin_unlock(&fat_cache_lru_lock);
 out:
-	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+	spin_unlock(&i->cache_lru_lock);
 }
 
-/*
- * Cache invalidation occurs rarely, thus the LRU chain is not updated. It
- * fixes itself after a while.
- */
 static void __fat_cache_inval_inode(struct inode *inode)
 {
 	struct msdos_inode_info *i = MSDOS_I(inode);
 	struct fat_cache *cache;
+	struct rb_node *n;
 
-	while (!list_empty(&i->cache_lru)) {
-		cache = list_entry(i->cache_lru.next, struct fat_cache, cache_list);
-		list_del_init(&cache->cache_list);
-		i->nr_caches--;
+	while ((n = rb_first(&i->cache_tree)) != NULL) {
+		cache = rb_entry(n, struct fat_cache, rb_node);
+		fat_cache_unlink(i, cache);
 		fat_cache_free(cache);
 	}
 	/* Update. The copy of caches before this id is discarded. */
@@ -206,9 +276,9 @@ static inline int cache_contiguous(struct fat_cache_id *cid, int dclus)
 	return ((cid->dcluster + cid->nr_contig) == dclus);
 }
 
+/* a new run, cid->id is kept from the lookup the walk started with */
 static inline void cache_init(struct fat_cache_id *cid, int fclus, int dclus)
 {
-	cid->id = FAT_CACHE_VALID;
 	cid->fcluster = fclus;
 	cid->dcluster = dclus;
 	cid->nr_contig = 0;
@@ -230,11 +300,8 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 		return 0;
 
 	if (fat_cache_lookup(inode, cluster, &cid, fclus, dclus) < 0) {
-		/*
-		 * dummy, always not contiguous
-		 * This is reinitialized by cache_init(), later.
-		 */
-		cache_init(&cid, -1, -1);
+		/* start the extent map at the head of the chain */
+		cache_init(&cid, 0, *dclus);
 	}
 
 	fatent_init(&fatent);
@@ -263,8 +330,12 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 		}
 		(*fclus)++;
 		*dclus = nr;
-		if (!cache_contiguous(&cid, *dclus))
+		if (!cache_contiguous(&cid, *dclus)) {
+			/* keep the run we walked through in the extent map */
+			cid.nr_contig--;
+			fat_cache_add(inode, &cid);
 			cache_init(&cid, *fclus, *dclus);
+		}
 	}
 	nr = 0;
 	fat_cache_add(inode, &cid);
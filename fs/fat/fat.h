@@ -6,6 +6,7 @@
 #include <linux/nls.h>
 #include <linux/fs.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
 #include <linux/msdos_fs.h>
 
 /*
@@ -96,7 +97,7 @@ struct msdos_sb_info {
  */
 struct msdos_inode_info {
 	spinlock_t cache_lru_lock;
-	struct list_head cache_lru;
+	struct rb_root cache_tree;	/* extents of the cluster chain */
 	int nr_caches;
 	/* for avoiding the race between fat_free() and fat_get_cluster() */
 	unsigned int cache_valid_id;
@@ -485,6 +485,14 @@ void generic_sync_sb_inodes(struct super_block *sb,
 			continue;		/* Skip a congested blockdev */
 		}
 
+		if (wbc->nonblocking && bdi_writeback_held(bdi)) {
+			/* Not congestion: nothing to wait for, skip quietly */
+			if (!sb_is_blkdev_sb(sb))
+				break;		/* Skip a held fs */
+			redirty_tail(inode);
+			continue;		/* Skip a held blockdev */
+		}
+
 		if (wbc->bdi && bdi != wbc->bdi) {
 			if (!sb_is_blkdev_sb(sb))
 				break;		/* fs has the wrong queue */
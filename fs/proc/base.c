@@ -1062,6 +1062,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	task->signal->oom_adj = oom_adjust;
 
 	unlock_task_sighand(task, &flags);
+	oom_adj_notify(task, OOM_ADJ_CHANGED);
 	put_task_struct(task);
 	if (end - buffer == 0)
 		return -EIO;
@@ -47,10 +47,15 @@ extern const char *yaffs_guts_c_version;
 #include <linux/proc_fs.h>
 #include <linux/smp_lock.h>
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
 #include <linux/mtd/mtd.h>
 #include <linux/interrupt.h>
 #include <linux/string.h>
 #include <linux/ctype.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/jiffies.h>
+#include <linux/vmalloc.h>
 
 #include "asm/div64.h"
 
@@ -121,16 +126,19 @@ static uint32_t YCALCBLOCKS(uint64_t partition_size, uint32_t block_size)
 unsigned int yaffs_traceMask = YAFFS_TRACE_BAD_BLOCKS;
 unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
+unsigned int yaffs_bg_gc_idle_ms = 500;	/* 0 disables background gc */
 
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
+module_param(yaffs_bg_gc_idle_ms, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
+MODULE_PARM(yaffs_bg_gc_idle_ms, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -237,11 +245,17 @@ static void yaffs_delete_inode(struct inode *);
 static void yaffs_clear_inode(struct inode *);
 
 static int yaffs_readpage(struct file *file, struct page *page);
+static int yaffs_readpages(struct file *file, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages);
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 static int yaffs_writepage(struct page *page, struct writeback_control *wbc);
 #else
 static int yaffs_writepage(struct page *page);
 #endif
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc);
+#endif
 
 
 #if (YAFFS_USE_WRITE_BEGIN_END != 0)
@@ -269,7 +283,11 @@ static int yaffs_follow_link(struct dentry *dentry, struct nameidata *nd);
 
 static struct address_space_operations yaffs_file_address_operations = {
 	.readpage = yaffs_readpage,
+	.readpages = yaffs_readpages,
 	.writepage = yaffs_writepage,
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+	.writepages = yaffs_writepages,
+#endif
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 	.write_begin = yaffs_write_begin,
 	.write_end = yaffs_write_end,
@@ -369,15 +387,96 @@ static void yaffs_GrossLock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs locking %p\n", current));
 	down(&dev->grossLock);
+	dev->lastActive = jiffies;
+	dev->lockedPageWrites = dev->nPageWrites;
 	T(YAFFS_TRACE_OS, ("yaffs locked %p\n", current));
 }
 
 static void yaffs_GrossUnlock(yaffs_Device *dev)
 {
 	T(YAFFS_TRACE_OS, ("yaffs unlocking %p\n", current));
+	/* Anything written may have left dirty blocks for the gc thread */
+	if (!dev->gcPending && dev->nPageWrites != dev->lockedPageWrites) {
+		dev->gcPending = 1;
+		if (dev->gcThread)
+			wake_up_process(dev->gcThread);
+	}
 	up(&dev->grossLock);
 }
 
+/*
+ * File data is moved one chunk at a time, with the gross lock dropped
+ * between chunks. Lookups and page reads queued behind a large read or
+ * write then only wait for the chunk in progress: the semaphore hands
+ * over to waiters in FIFO order. This only bounds the wait: every chunk
+ * is still moved under the gross lock, so readers and writers never run
+ * at the same time. Concurrent access to the same pages is already
+ * excluded by the page lock.
+ *
+ * The gross lock is not split into object and allocator locks. A read
+ * changes device state too: the short op cache and its LRU, the temp and
+ * spare buffers, block state on ECC errors. A split needs its own locks
+ * for all of those first.
+ */
+static int yaffs_ChunkBytes(yaffs_Device *dev, loff_t offset, int nBytes)
+{
+	int n = dev->nDataBytesPerChunk -
+		((__u32)offset % dev->nDataBytesPerChunk);
+
+	return (n < nBytes) ? n : nBytes;
+}
+
+static int yaffs_ReadDataUnlocked(yaffs_Object *obj, __u8 *buffer,
+				loff_t offset, int nBytes,
+				yaffs_ReadCursor *cursor)
+{
+	yaffs_Device *dev = obj->myDev;
+	int nDone = 0;
+	int n, ret;
+
+	while (nDone < nBytes) {
+		n = yaffs_ChunkBytes(dev, offset + nDone, nBytes - nDone);
+
+		yaffs_GrossLock(dev);
+		ret = yaffs_ReadDataFromFileCursor(obj, buffer + nDone,
+					offset + nDone, n, cursor);
+		yaffs_GrossUnlock(dev);
+
+		if (ret < 0)
+			return ret;
+		nDone += ret;
+		if (ret != n)
+			break;
+	}
+
+	return nDone;
+}
+
+static int yaffs_WriteDataUnlocked(yaffs_Object *obj, const __u8 *buffer,
+				loff_t offset, int nBytes)
+{
+	yaffs_Device *dev = obj->myDev;
+	int nDone = 0;
+	int n, ret;
+
+	while (nDone < nBytes) {
+		n = yaffs_ChunkBytes(dev, offset + nDone, nBytes - nDone);
+
+		yaffs_GrossLock(dev);
+		ret = yaffs_WriteDataToFile(obj, buffer + nDone,
+					offset + nDone, n, 0);
+		yaffs_GrossUnlock(dev);
+
+		if (ret <= 0)
+			break;
+		nDone += ret;
+		if (ret != n)
+			break;
+	}
+
+	return nDone;
+}
+
 
 /*-----------------------------------------------------------------*/
 /* Directory search context allows us to unlock access to yaffs during
@@ -717,19 +816,16 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	/* Lifted from jffs2 */
 
 	yaffs_Object *obj;
+	yaffs_ReadCursor cursor;
 	unsigned char *pg_buf;
 	int ret;
 
-	yaffs_Device *dev;
-
 	T(YAFFS_TRACE_OS, ("yaffs_readpage at %08x, size %08x\n",
 			(unsigned)(pg->index << PAGE_CACHE_SHIFT),
 			(unsigned)PAGE_CACHE_SIZE));
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
-	dev = obj->myDev;
-
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 	BUG_ON(!PageLocked(pg));
 #else
@@ -740,13 +836,10 @@ static int yaffs_readpage_nolock(struct file *f, struct page *pg)
 	pg_buf = kmap(pg);
 	/* FIXME: Can kmap fail? */
 
-	yaffs_GrossLock(dev);
-
-	ret = yaffs_ReadDataFromFile(obj, pg_buf,
+	memset(&cursor, 0, sizeof(cursor));
+	ret = yaffs_ReadDataUnlocked(obj, pg_buf,
 				pg->index << PAGE_CACHE_SHIFT,
-				PAGE_CACHE_SIZE);
-
-	yaffs_GrossUnlock(dev);
+				PAGE_CACHE_SIZE, &cursor);
 
 	if (ret >= 0)
 		ret = 0;
@@ -778,6 +871,85 @@ static int yaffs_readpage(struct file *f, struct page *pg)
 	return yaffs_readpage_unlock(f, pg);
 }
 
+/* Pages handed to readpages are read in batches of up to a level 0
+ * tnode's worth of chunks. The gross lock is taken per chunk as in
+ * yaffs_ReadDataUnlocked, but a batch shares one read cursor, so the
+ * tnode tree is walked once per batch rather than once per chunk. Pages
+ * are put in the page cache before reading, as that may allocate and so
+ * recurse into writepage.
+ */
+#define YAFFS_READPAGES_BATCH	16
+
+static int yaffs_readpages(struct file *f, struct address_space *mapping,
+				struct list_head *pages, unsigned nr_pages)
+{
+	yaffs_Object *obj = yaffs_DentryToObject(f->f_dentry);
+	yaffs_Device *dev = obj->myDev;
+	struct page *batch[YAFFS_READPAGES_BATCH];
+	yaffs_ReadCursor cursor;
+	struct page *pg;
+	unsigned char *pg_buf;
+	int maxBatch;
+	int nBatch;
+	int ret;
+	int i;
+
+	maxBatch = (YAFFS_NTNODES_LEVEL0 * dev->nDataBytesPerChunk) /
+			PAGE_CACHE_SIZE;
+	if (maxBatch < 1)
+		maxBatch = 1;
+	if (maxBatch > YAFFS_READPAGES_BATCH)
+		maxBatch = YAFFS_READPAGES_BATCH;
+
+	T(YAFFS_TRACE_OS, ("yaffs_readpages %u pages\n", nr_pages));
+
+	while (nr_pages) {
+		nBatch = 0;
+		while (nr_pages && nBatch < maxBatch) {
+			pg = list_entry(pages->prev, struct page, lru);
+			list_del(&pg->lru);
+			nr_pages--;
+
+			if (!add_to_page_cache_lru(pg, mapping, pg->index,
+						   GFP_KERNEL))
+				batch[nBatch++] = pg;
+			else
+				page_cache_release(pg);
+		}
+
+		if (!nBatch)
+			continue;
+
+		memset(&cursor, 0, sizeof(cursor));
+
+		for (i = 0; i < nBatch; i++) {
+			pg = batch[i];
+			pg_buf = kmap(pg);
+
+			ret = yaffs_ReadDataUnlocked(obj, pg_buf,
+					((loff_t)pg->index) << PAGE_CACHE_SHIFT,
+					PAGE_CACHE_SIZE, &cursor);
+
+			if (ret < 0) {
+				ClearPageUptodate(pg);
+				SetPageError(pg);
+			} else {
+				SetPageUptodate(pg);
+				ClearPageError(pg);
+			}
+
+			flush_dcache_page(pg);
+			kunmap(pg);
+			unlock_page(pg);
+		}
+
+		for (i = 0; i < nBatch; i++)
+			page_cache_release(batch[i]);
+	}
+
+	return 0;
+}
+
 /* writepage inspired by/stolen from smbfs */
 
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
@@ -825,7 +997,6 @@ static int yaffs_writepage(struct page *page)
 	buffer = kmap(page);
 
 	obj = yaffs_InodeToObject(inode);
-	yaffs_GrossLock(obj->myDev);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_writepage at %08x, size %08x\n",
@@ -834,15 +1005,13 @@ static int yaffs_writepage(struct page *page)
 		("writepag0: obj = %05x, ino = %05x\n",
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
-	nWritten = yaffs_WriteDataToFile(obj, buffer,
-			page->index << PAGE_CACHE_SHIFT, nBytes, 0);
+	nWritten = yaffs_WriteDataUnlocked(obj, buffer,
+			page->index << PAGE_CACHE_SHIFT, nBytes);
 
 	T(YAFFS_TRACE_OS,
 		("writepag1: obj = %05x, ino = %05x\n",
 		(int)obj->variant.fileVariant.fileSize, (int)inode->i_size));
 
-	yaffs_GrossUnlock(obj->myDev);
-
 	kunmap(page);
 	SetPageUptodate(page);
 	UnlockPage(page);
@@ -851,6 +1020,121 @@ static int yaffs_writepage(struct page *page)
 	return (nWritten == nBytes) ? 0 : -ENOSPC;
 }
 
+/* writepages gathers runs of contiguous dirty pages and writes each run
+ * with a single call, so that chunks spanning page boundaries (chunks
+ * bigger than a page, or inband tags) are written whole rather than
+ * pieced together a page at a time in the short op cache. The pages are
+ * gathered in a buffer allocated at mount, only on devices where chunks
+ * can span pages; elsewhere each page is written straight from the page
+ * cache by writepage.
+ */
+#define YAFFS_WRITEPAGES_BATCH	16
+
+#if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 22))
+typedef struct {
+	struct inode *inode;
+	struct page *pages[YAFFS_WRITEPAGES_BATCH];
+	int nPages;
+	__u8 *buffer;
+} yaffs_WritepagesBatch;
+
+static int yaffs_FlushWritepagesBatch(yaffs_WritepagesBatch *batch)
+{
+	struct inode *inode = batch->inode;
+	yaffs_Object *obj = yaffs_InodeToObject(inode);
+	loff_t offset;
+	loff_t size;
+	char *buffer;
+	int nWritten = 0;
+	int nBytes;
+	int i;
+
+	if (!batch->nPages)
+		return 0;
+
+	offset = ((loff_t)batch->pages[0]->index) << PAGE_CACHE_SHIFT;
+	size = i_size_read(inode);
+
+	nBytes = batch->nPages * PAGE_CACHE_SIZE;
+	if (offset + nBytes > size)
+		nBytes = (size > offset) ? (int)(size - offset) : 0;
+
+	for (i = 0; i < batch->nPages &&
+		    i * PAGE_CACHE_SIZE < nBytes; i++) {
+		buffer = kmap(batch->pages[i]);
+		memcpy(batch->buffer + i * PAGE_CACHE_SIZE, buffer,
+		       PAGE_CACHE_SIZE);
+		kunmap(batch->pages[i]);
+	}
+
+	T(YAFFS_TRACE_OS,
+		("yaffs_writepages at %08x, %d pages, size %08x\n",
+		(unsigned)offset, batch->nPages, nBytes));
+
+	if (nBytes)
+		nWritten = yaffs_WriteDataUnlocked(obj, batch->buffer,
+						offset, nBytes);
+
+	for (i = 0; i < batch->nPages; i++) {
+		SetPageUptodate(batch->pages[i]);
+		unlock_page(batch->pages[i]);
+		page_cache_release(batch->pages[i]);
+	}
+	batch->nPages = 0;
+
+	return (nWritten == nBytes) ? 0 : -ENOSPC;
+}
+
+static int yaffs_WritepagesAdd(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	yaffs_WritepagesBatch *batch = (yaffs_WritepagesBatch *)data;
+	loff_t offset = ((loff_t)page->index) << PAGE_CACHE_SHIFT;
+	int ret = 0;
+
+	if (offset > i_size_read(batch->inode)) {
+		/* Beyond the end of file, don't care */
+		unlock_page(page);
+		return 0;
+	}
+
+	if (batch->nPages &&
+	    (batch->nPages == YAFFS_WRITEPAGES_BATCH ||
+	     batch->pages[batch->nPages - 1]->index + 1 != page->index))
+		ret = yaffs_FlushWritepagesBatch(batch);
+
+	page_cache_get(page);
+	batch->pages[batch->nPages++] = page;
+
+	return ret;
+}
+
+static int yaffs_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	yaffs_Device *dev = yaffs_SuperToDevice(mapping->host->i_sb);
+	yaffs_WritepagesBatch batch;
+	int ret;
+	int ret2;
+
+	if (!dev->writepagesBuffer)
+		return generic_writepages(mapping, wbc);
+
+	down(&dev->writepagesLock);
+
+	batch.buffer = dev->writepagesBuffer;
+	batch.inode = mapping->host;
+	batch.nPages = 0;
+
+	ret = write_cache_pages(mapping, wbc, yaffs_WritepagesAdd, &batch);
+	ret2 = yaffs_FlushWritepagesBatch(&batch);
+
+	up(&dev->writepagesLock);
+
+	return ret ? ret : ret2;
+}
+#endif
+
 
 #if (YAFFS_USE_WRITE_BEGIN_END > 0)
 static int yaffs_write_begin(struct file *filp, struct address_space *mapping,
@@ -1151,14 +1435,9 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 	yaffs_Object *obj;
 	int nWritten, ipos;
 	struct inode *inode;
-	yaffs_Device *dev;
 
 	obj = yaffs_DentryToObject(f->f_dentry);
 
-	dev = obj->myDev;
-
-	yaffs_GrossLock(dev);
-
 	inode = f->f_dentry->d_inode;
 
 	if (!S_ISBLK(inode->i_mode) && f->f_flags & O_APPEND)
@@ -1175,7 +1454,7 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 			"to object %d at %d\n",
 			n, obj->objectId, ipos));
 
-	nWritten = yaffs_WriteDataToFile(obj, buf, ipos, n, 0);
+	nWritten = yaffs_WriteDataUnlocked(obj, buf, ipos, n);
 
 	T(YAFFS_TRACE_OS,
 		("yaffs_file_write writing %zu bytes, %d written at %d\n",
@@ -1195,7 +1474,6 @@ static ssize_t yaffs_file_write(struct file *f, const char *buf, size_t n,
 		}
 
 	}
-	yaffs_GrossUnlock(dev);
 	return (nWritten == 0) && (n > 0) ? -ENOSPC : nWritten;
 }
 
@@ -1226,18 +1504,7 @@ static ssize_t yaffs_hold_space(struct file *f)
 
 static void yaffs_release_space(struct file *f)
 {
-	yaffs_Object *obj;
-	yaffs_Device *dev;
-
-
-	obj = yaffs_DentryToObject(f->f_dentry);
-
-	dev = obj->myDev;
-
-	yaffs_GrossLock(dev);
-
-
-	yaffs_GrossUnlock(dev);
+	/* Nothing is reserved by yaffs_hold_space() yet */
 }
 
 static int yaffs_readdir(struct file *f, void *dirent, filldir_t filldir)
@@ -1875,12 +2142,72 @@ static int yaffs_remount_fs(struct super_block *sb, int *flags, char *data)
 }
 #endif
 
+/* Background garbage collection.
+ * Once the file system has been left alone for yaffs_bg_gc_idle_ms the
+ * thread collects dirty blocks a step at a time, so that writes find
+ * erased blocks waiting for them instead of collecting inline. It backs
+ * off as soon as anybody else wants the device. After a pass that found
+ * nothing to collect, it sleeps until yaffs_GrossUnlock sees a write.
+ */
+static int yaffs_BackgroundGcThread(void *data)
+{
+	yaffs_Device *dev = (yaffs_Device *)data;
+	struct super_block *sb = (struct super_block *)dev->superBlock;
+	unsigned long idle;
+	long timeout;
+	int moreToDo = 0;
+
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		idle = msecs_to_jiffies(yaffs_bg_gc_idle_ms);
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (moreToDo)
+			timeout = 1;
+		else if (dev->gcPending && idle) {
+			timeout = (long)(dev->lastActive + idle - jiffies);
+			if (timeout < 1)
+				timeout = 1;
+		} else
+			timeout = MAX_SCHEDULE_TIMEOUT;
+		if (kthread_should_stop()) {
+			__set_current_state(TASK_RUNNING);
+			break;
+		}
+		schedule_timeout(timeout);
+
+		try_to_freeze();
+		moreToDo = 0;
+
+		if (!dev->gcPending || !idle || (sb->s_flags & MS_RDONLY) ||
+		    time_before(jiffies, dev->lastActive + idle))
+			continue;
+
+		if (down_trylock(&dev->grossLock))
+			continue;
+
+		moreToDo = yaffs_BackgroundGarbageCollect(dev);
+		if (!moreToDo)
+			dev->gcPending = 0;
+
+		up(&dev->grossLock);
+	}
+
+	return 0;
+}
+
 static void yaffs_put_super(struct super_block *sb)
 {
 	yaffs_Device *dev = yaffs_SuperToDevice(sb);
 
 	T(YAFFS_TRACE_OS, ("yaffs_put_super\n"));
 
+	if (dev->gcThread) {
+		kthread_stop(dev->gcThread);
+		dev->gcThread = NULL;
+	}
+
 	yaffs_GrossLock(dev);
 
 	yaffs_FlushEntireDeviceCache(dev);
@@ -1902,6 +2229,11 @@ static void yaffs_put_super(struct super_block *sb)
 		dev->spareBuffer = NULL;
 	}
 
+	if (dev->writepagesBuffer) {
+		vfree(dev->writepagesBuffer);
+		dev->writepagesBuffer = NULL;
+	}
+
 	kfree(dev);
 }
 
@@ -1931,6 +2263,7 @@ typedef struct {
 	int skip_checkpoint_read;
 	int skip_checkpoint_write;
 	int no_cache;
+	int cache_size;
 	int empty_lost_and_found_overridden;
 	int empty_lost_and_found;
 } yaffs_options;
@@ -1963,6 +2296,9 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 			options->inband_tags = 1;
 		else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
+		else if (!strncmp(cur_opt, "cache-size=", 11))
+			options->cache_size =
+				simple_strtoul(cur_opt + 11, NULL, 10);
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
 			options->skip_checkpoint_read = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-write"))
@@ -2187,7 +2523,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	dev->nChunksPerBlock = YAFFS_CHUNKS_PER_BLOCK;
 	dev->totalBytesPerChunk = YAFFS_BYTES_PER_CHUNK;
 	dev->nReservedBlocks = 5;
-	dev->nShortOpCaches = (options.no_cache) ? 0 : 10;
+	if (options.no_cache)
+		dev->nShortOpCaches = 0;
+	else if (options.cache_size)
+		dev->nShortOpCaches = options.cache_size;
+	else
+		dev->nShortOpCaches = 10;
 	dev->inbandTags = options.inband_tags;
 
 	/* ... and the functions. */
@@ -2196,6 +2537,7 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 		    nandmtd2_WriteChunkWithTagsToNAND;
 		dev->readChunkWithTagsFromNAND =
 		    nandmtd2_ReadChunkWithTagsFromNAND;
+		dev->readBlockTagsFromNAND = nandmtd2_ReadBlockTagsFromNAND;
 		dev->markNANDBlockBad = nandmtd2_MarkNANDBlockBad;
 		dev->queryNANDBlock = nandmtd2_QueryNANDBlock;
 		dev->spareBuffer = YMALLOC(mtd->oobsize);
@@ -2293,6 +2635,22 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	T(YAFFS_TRACE_ALWAYS,
 	  ("yaffs_read_super: isCheckpointed %d\n", dev->isCheckpointed));
 
+	init_MUTEX(&dev->writepagesLock);
+	dev->writepagesBuffer = NULL;
+	if (dev->nDataBytesPerChunk > PAGE_CACHE_SIZE || dev->inbandTags)
+		dev->writepagesBuffer =
+			vmalloc(YAFFS_WRITEPAGES_BATCH * PAGE_CACHE_SIZE);
+
+	dev->lastActive = jiffies;
+	dev->gcPending = 1;	/* one pass for what the last mount left */
+	dev->gcThread = kthread_run(yaffs_BackgroundGcThread, dev,
+				    "yaffs-gc-%s", dev->name);
+	if (IS_ERR(dev->gcThread)) {
+		T(YAFFS_TRACE_ALWAYS,
+		  ("yaffs_read_super: no background gc for %s\n", dev->name));
+		dev->gcThread = NULL;
+	}
+
 	T(YAFFS_TRACE_OS, ("yaffs_read_super: done\n"));
 	return sb;
 }
@@ -2417,6 +2775,8 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "garbageCollections. %d\n", dev->garbageCollections);
 	buf += sprintf(buf, "passiveGCs......... %d\n",
 		    dev->passiveGarbageCollections);
+	buf += sprintf(buf, "backgroundGCs...... %d\n",
+		    dev->backgroundGarbageCollections);
 	buf += sprintf(buf, "nRetriedWrites..... %d\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->nShortOpCaches);
 	buf += sprintf(buf, "nRetireBlocks...... %d\n", dev->nRetiredBlocks);
@@ -2425,6 +2785,14 @@ static char *yaffs_dump_dev(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "tagsEccFixed....... %d\n", dev->tagsEccFixed);
 	buf += sprintf(buf, "tagsEccUnfixed..... %d\n", dev->tagsEccUnfixed);
 	buf += sprintf(buf, "cacheHits.......... %d\n", dev->cacheHits);
+	buf += sprintf(buf, "cacheMisses........ %d\n", dev->cacheMisses);
+	buf += sprintf(buf, "cacheHitRate....... %d%%\n",
+		    (dev->cacheHits + dev->cacheMisses) ?
+		    (int)(dev->cacheHits * 100LL /
+			  (dev->cacheHits + dev->cacheMisses)) : 0);
+	buf += sprintf(buf, "cacheWrites........ %d\n", dev->cacheWrites);
+	buf += sprintf(buf, "cacheWriteBacks.... %d\n", dev->cacheWriteBacks);
+	buf += sprintf(buf, "nDirtyCaches....... %d\n", dev->nDirtyCaches);
 	buf += sprintf(buf, "nDeletedFiles...... %d\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %d\n", dev->nUnlinkedFiles);
 	buf +=
@@ -76,6 +76,8 @@ static int yaffs_DoGenericObjectDeletion(yaffs_Object *in);
 
 static yaffs_BlockInfo *yaffs_GetBlockInfo(yaffs_Device *dev, int blockNo);
 
+static void yaffs_GcBinRemove(yaffs_Device *dev, int blockNo);
+static void yaffs_GcBinUpdate(yaffs_Device *dev, int blockNo);
 
 static int yaffs_CheckChunkErased(struct yaffs_DeviceStruct *dev,
 				int chunkInNAND);
@@ -1292,6 +1294,7 @@ static void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
 		tn->internal[0] = dev->freeTnodes;
 		dev->freeTnodes = tn;
 		dev->nFreeTnodes++;
+		dev->tnodeFreeSeq++;
 	}
 	dev->nCheckpointBlocksRequired = 0; /* force recalculation*/
 }
@@ -1665,6 +1668,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 	if (theBlock) {
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
+		yaffs_GcBinUpdate(dev, chunk / dev->nChunksPerBlock);
 	}
 }
 
@@ -2535,6 +2539,7 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 
 	dev->blockInfo = NULL;
 	dev->chunkBits = NULL;
+	dev->gcBinHead = NULL;
 
 	dev->allocationBlock = -1;	/* force it to get a new one */
 
@@ -2558,8 +2563,26 @@ static int yaffs_InitialiseBlocks(yaffs_Device *dev)
 	}
 
 	if (dev->blockInfo && dev->chunkBits) {
+		/* One array holds the bin heads and the per block links */
+		int nInts = dev->nChunksPerBlock + 1 + 3 * nBlocks;
+
+		dev->gcBinHead = YMALLOC(nInts * sizeof(int));
+		if (!dev->gcBinHead) {
+			dev->gcBinHead = YMALLOC_ALT(nInts * sizeof(int));
+			dev->gcBinsAlt = 1;
+		} else
+			dev->gcBinsAlt = 0;
+	}
+
+	if (dev->blockInfo && dev->chunkBits && dev->gcBinHead) {
 		memset(dev->blockInfo, 0, nBlocks * sizeof(yaffs_BlockInfo));
 		memset(dev->chunkBits, 0, dev->chunkBitmapStride * nBlocks);
+
+		dev->gcBinNext = dev->gcBinHead + dev->nChunksPerBlock + 1;
+		dev->gcBinPrev = dev->gcBinNext + nBlocks;
+		dev->gcBinOf = dev->gcBinPrev + nBlocks;
+		memset(dev->gcBinHead, 0xff,
+			(dev->nChunksPerBlock + 1 + 3 * nBlocks) * sizeof(int));
 		return YAFFS_OK;
 	}
 
@@ -2583,6 +2606,108 @@ static void yaffs_DeinitialiseBlocks(yaffs_Device *dev)
 		YFREE(dev->chunkBits);
 	dev->chunkBitsAlt = 0;
 	dev->chunkBits = NULL;
+
+	if (dev->gcBinsAlt && dev->gcBinHead)
+		YFREE_ALT(dev->gcBinHead);
+	else if (dev->gcBinHead)
+		YFREE(dev->gcBinHead);
+	dev->gcBinsAlt = 0;
+	dev->gcBinHead = NULL;
+	dev->gcBinNext = NULL;
+	dev->gcBinPrev = NULL;
+	dev->gcBinOf = NULL;
+}
+
+/* GC bins
+ * Each full block sits in the bin for its number of live chunks
+ * (pagesInUse - softDeletions), so the dirtiest candidates are found by
+ * looking at the lowest non-empty bins rather than scanning every block.
+ * Blocks in any other state are not binned.
+ */
+
+static int yaffs_GcBinLiveChunks(yaffs_Device *dev, yaffs_BlockInfo *bi)
+{
+	int live = bi->pagesInUse - bi->softDeletions;
+
+	if (live < 0)
+		live = 0;
+	if (live > dev->nChunksPerBlock)
+		live = dev->nChunksPerBlock;
+	return live;
+}
+
+static void yaffs_GcBinRemove(yaffs_Device *dev, int blockNo)
+{
+	int i = blockNo - dev->internalStartBlock;
+	int bin;
+	int next;
+	int prev;
+
+	if (!dev->gcBinHead)
+		return;
+
+	bin = dev->gcBinOf[i];
+	if (bin < 0)
+		return;
+
+	next = dev->gcBinNext[i];
+	prev = dev->gcBinPrev[i];
+
+	if (prev >= 0)
+		dev->gcBinNext[prev - dev->internalStartBlock] = next;
+	else
+		dev->gcBinHead[bin] = next;
+
+	if (next >= 0)
+		dev->gcBinPrev[next - dev->internalStartBlock] = prev;
+
+	dev->gcBinOf[i] = -1;
+}
+
+/* Refile a block after its state or live chunk count has changed. */
+static void yaffs_GcBinUpdate(yaffs_Device *dev, int blockNo)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blockNo);
+	int i = blockNo - dev->internalStartBlock;
+	int bin = -1;
+	int next;
+
+	if (!dev->gcBinHead)
+		return;
+
+	if (bi->blockState == YAFFS_BLOCK_STATE_FULL)
+		bin = yaffs_GcBinLiveChunks(dev, bi);
+
+	if (dev->gcBinOf[i] == bin)
+		return;
+
+	yaffs_GcBinRemove(dev, blockNo);
+
+	if (bin < 0)
+		return;
+
+	next = dev->gcBinHead[bin];
+	dev->gcBinNext[i] = next;
+	dev->gcBinPrev[i] = -1;
+	if (next >= 0)
+		dev->gcBinPrev[next - dev->internalStartBlock] = blockNo;
+	dev->gcBinHead[bin] = blockNo;
+	dev->gcBinOf[i] = bin;
+}
+
+/* Scanning and checkpoint restore set up the block info wholesale, so the
+ * bins get rebuilt once the device is up.
+ */
+static void yaffs_RebuildGcBins(yaffs_Device *dev)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int i;
+
+	memset(dev->gcBinHead, 0xff,
+		(dev->nChunksPerBlock + 1 + 3 * nBlocks) * sizeof(int));
+
+	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++)
+		yaffs_GcBinUpdate(dev, i);
 }
 
 static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
@@ -2626,13 +2751,43 @@ static int yaffs_BlockNotDisqualifiedFromGC(yaffs_Device *dev,
  * for garbage collection.
  */
 
+/* Take the first block out of the lowest bin that may be collected and has
+ * no more than maxLive chunks in use.
+ */
+static int yaffs_FindDirtiestBlock(yaffs_Device *dev, int maxLive)
+{
+	int bin;
+	int b;
+	int next;
+	int dirtiest = -1;
+	yaffs_BlockInfo *bi;
+
+	for (bin = 0; bin <= maxLive && dirtiest < 0; bin++) {
+		for (b = dev->gcBinHead[bin]; b >= 0 && dirtiest < 0; b = next) {
+			next = dev->gcBinNext[b - dev->internalStartBlock];
+			bi = yaffs_GetBlockInfo(dev, b);
+
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+			    yaffs_GcBinLiveChunks(dev, bi) != bin) {
+				/* Stale entry, put it where it belongs */
+				yaffs_GcBinUpdate(dev, b);
+				continue;
+			}
+
+			if (yaffs_BlockNotDisqualifiedFromGC(dev, bi))
+				dirtiest = b;
+		}
+	}
+
+	dev->oldestDirtySequence = 0;
+
+	return dirtiest;
+}
+
 static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 					int aggressive)
 {
-	int b = dev->currentDirtyChecker;
-
 	int i;
-	int iterations;
 	int dirtiest = -1;
 	int pagesInUse = 0;
 	int prioritised = 0;
@@ -2673,44 +2828,16 @@ static int yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	if (!aggressive && (dev->nonAggressiveSkip > 0))
 		return -1;
 
-	if (!prioritised)
-		pagesInUse =
-			(aggressive) ? dev->nChunksPerBlock : YAFFS_PASSIVE_GC_CHUNKS + 1;
-
-	if (aggressive)
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-	else {
-		iterations =
-		    dev->internalEndBlock - dev->internalStartBlock + 1;
-		iterations = iterations / 16;
-		if (iterations > 200)
-			iterations = 200;
-	}
-
-	for (i = 0; i <= iterations && pagesInUse > 0 && !prioritised; i++) {
-		b++;
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock)
-			b = dev->internalStartBlock;
-
-		if (b < dev->internalStartBlock || b > dev->internalEndBlock) {
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("**>> Block %d is not valid" TENDSTR), b));
-			YBUG();
-		}
-
-		bi = yaffs_GetBlockInfo(dev, b);
-
-		if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-			(bi->pagesInUse - bi->softDeletions) < pagesInUse &&
-				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
-			dirtiest = b;
+	if (!prioritised) {
+		dirtiest = yaffs_FindDirtiestBlock(dev,
+				(aggressive) ? dev->nChunksPerBlock - 1 :
+					YAFFS_PASSIVE_GC_CHUNKS);
+		if (dirtiest > 0) {
+			bi = yaffs_GetBlockInfo(dev, dirtiest);
 			pagesInUse = (bi->pagesInUse - bi->softDeletions);
 		}
 	}
 
-	dev->currentDirtyChecker = b;
-
 	if (dirtiest > 0) {
 		T(YAFFS_TRACE_GC,
 		  (TSTR("GC Selected block %d with %d free, prioritised:%d" TENDSTR), dirtiest,
@@ -2739,6 +2866,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		(TSTR("yaffs_BlockBecameDirty block %d state %d %s"TENDSTR),
 		blockNo, bi->blockState, (bi->needsRetiring) ? "needs retiring" : ""));
 
+	yaffs_GcBinRemove(dev, blockNo);
 	bi->blockState = YAFFS_BLOCK_STATE_DIRTY;
 
 	if (!bi->needsRetiring) {
@@ -2934,6 +3062,7 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 		/* If the block is full set the state to full */
 		if (dev->allocationPage >= dev->nChunksPerBlock) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
+			yaffs_GcBinUpdate(dev, dev->allocationBlock);
 			dev->allocationBlock = -1;
 		}
 
@@ -2998,6 +3127,7 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 
 	if(bi->blockState == YAFFS_BLOCK_STATE_FULL)
 		bi->blockState = YAFFS_BLOCK_STATE_COLLECTING;
+	yaffs_GcBinRemove(dev, block);
 	
 	bi->hasShrinkHeader = 0;	/* clear the flag so that the block can erase */
 
@@ -3226,6 +3356,7 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 {
 	int block;
 	int aggressive;
+	int wholeBlock;
 	int gcOk = YAFFS_OK;
 	int maxTries = 0;
 
@@ -3272,7 +3403,14 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 			   ("yaffs: GC erasedBlocks %d aggressive %d" TENDSTR),
 			   dev->nErasedBlocks, aggressive));
 
-			gcOk = yaffs_GarbageCollectBlock(dev, block, aggressive);
+			/* Bound the copying done on behalf of a single write
+			 * unless the reserve is already being eaten into.
+			 */
+			wholeBlock = aggressive &&
+				(dev->nErasedBlocks <=
+				 dev->nReservedBlocks + checkpointBlockAdjust);
+
+			gcOk = yaffs_GarbageCollectBlock(dev, block, wholeBlock);
 		}
 
 		if (dev->nErasedBlocks < (dev->nReservedBlocks) && block > 0) {
@@ -3288,6 +3426,50 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev)
 	return aggressive ? gcOk : YAFFS_OK;
 }
 
+/* One step of idle time garbage collection, called with the device locked.
+ * The dirtier the device, the fuller the blocks we are prepared to collect,
+ * with the aim of keeping the write path out of aggressive gc. Each call
+ * copies at most a few chunks.
+ * Returns nonzero if there is more to do.
+ */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev)
+{
+	int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
+	int checkpointBlockAdjust;
+	int maxLive;
+
+	if (dev->isDoingGC || !dev->gcBinHead)
+		return 0;
+
+	if (dev->gcBlock <= 0) {
+		checkpointBlockAdjust = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
+		if (checkpointBlockAdjust < 0)
+			checkpointBlockAdjust = 0;
+
+		if (dev->nErasedBlocks < 2 * (dev->nReservedBlocks + checkpointBlockAdjust + 2))
+			maxLive = dev->nChunksPerBlock - 1;
+		else if (dev->nErasedBlocks < nBlocks / 4)
+			maxLive = dev->nChunksPerBlock / 2;
+		else
+			maxLive = 0;	/* Only blocks that need no copying */
+
+		dev->gcBlock = yaffs_FindDirtiestBlock(dev, maxLive);
+		dev->gcChunk = 0;
+
+		if (dev->gcBlock <= 0)
+			return 0;
+
+		T(YAFFS_TRACE_GC,
+		  (TSTR("yaffs: background GC block %d erasedBlocks %d" TENDSTR),
+		   dev->gcBlock, dev->nErasedBlocks));
+	}
+
+	dev->backgroundGarbageCollections++;
+	yaffs_GarbageCollectBlock(dev, dev->gcBlock, 0);
+
+	return 1;
+}
+
 /*-------------------------  TAGS --------------------------------*/
 
 static int yaffs_TagsMatch(const yaffs_ExtendedTags *tags, int objectId,
@@ -3621,6 +3803,7 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 			yaffs_BlockBecameDirty(dev, block);
 		}
 
+		yaffs_GcBinUpdate(dev, block);
 	}
 
 }
@@ -3859,17 +4042,57 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   need a very intelligent search.
  */
 
+static int yaffs_CacheHash(const yaffs_Object *obj, int chunkId)
+{
+	return (obj->objectId * 31 + chunkId) & (YAFFS_CACHE_HASH_SIZE - 1);
+}
+
+static void yaffs_SetChunkCacheDirty(yaffs_Device *dev,
+				yaffs_ChunkCache *cache, int dirty)
+{
+	if (dirty && !cache->dirty) {
+		ylist_add_tail(&cache->dirtyLink, &dev->srCacheDirty);
+		dev->nDirtyCaches++;
+	} else if (!dirty && cache->dirty) {
+		ylist_del_init(&cache->dirtyLink);
+		dev->nDirtyCaches--;
+	}
+	cache->dirty = dirty;
+}
+
+/* Attach a free cache entry to a chunk of an object. */
+static void yaffs_AssignChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
+				yaffs_Object *obj, int chunkId)
+{
+	cache->object = obj;
+	cache->chunkId = chunkId;
+	cache->locked = 0;
+	yaffs_SetChunkCacheDirty(dev, cache, 0);
+	ylist_add(&cache->hashLink,
+		&dev->srCacheHash[yaffs_CacheHash(obj, chunkId)]);
+}
+
+/* Drop a cache entry. Free entries go to the front of the LRU to be reused first. */
+static void yaffs_FreeChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_SetChunkCacheDirty(dev, cache, 0);
+	if (cache->object) {
+		ylist_del_init(&cache->hashLink);
+		cache->object = NULL;
+	}
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srCacheLru);
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	ylist_for_each(i, &dev->srCacheDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+		if (cache->object == obj)
 			return 1;
 	}
 
@@ -3877,55 +4100,67 @@ static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 }
 
 
+static int yaffs_CacheChunkIdCompare(const void *a, const void *b)
+{
+	const yaffs_ChunkCache *ca = *(const yaffs_ChunkCache **)a;
+	const yaffs_ChunkCache *cb = *(const yaffs_ChunkCache **)b;
+
+	return ca->chunkId - cb->chunkId;
+}
+
+/* Write out the dirty chunks of an object in chunk order. The dirty list
+ * is scanned once and what is found sorted, instead of being rescanned
+ * for every chunk written. An entry can be invalidated while a chunk is
+ * written (garbage collection deleting the object), so each one is
+ * checked again before use.
+ */
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	yaffs_ChunkCache **flush = dev->srCacheFlush;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	int chunkWritten;
+	int nFlush = 0;
+	int n;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->nShortOpCaches <= 0 || !flush)
+		return;
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	ylist_for_each(i, &dev->srCacheDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+		if (cache->object == obj)
+			flush[nFlush++] = cache;
+	}
 
-		} while (cache && chunkWritten > 0);
+	if (nFlush > 1)
+		yaffs_qsort(flush, nFlush, sizeof(yaffs_ChunkCache *),
+			yaffs_CacheChunkIdCompare);
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	for (n = 0; n < nFlush; n++) {
+		cache = flush[n];
+		if (cache->object != obj || !cache->dirty)
+			continue;
+		if (cache->locked)
+			break;
 
-		}
+		/* Write it out and free it up */
+		chunkWritten = yaffs_WriteChunkDataToObject(cache->object,
+							cache->chunkId,
+							cache->data,
+							cache->nBytes,
+							1);
+		dev->cacheWriteBacks++;
+		yaffs_FreeChunkCache(dev, cache);
+		if (chunkWritten <= 0)
+			break;
 	}
 
+	if (n < nFlush) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	}
 }
 
 /*yaffs_FlushEntireDeviceCache(dev)
@@ -3936,20 +4171,15 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
 	yaffs_Object *obj;
-	int nCaches = dev->nShortOpCaches;
-	int i;
 
 	/* Find a dirty object in the cache and flush it...
 	 * until there are no further dirty objects.
 	 */
 	do {
 		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
-
-		}
+		if (!ylist_empty(&dev->srCacheDirty))
+			obj = ylist_entry(dev->srCacheDirty.next,
+					yaffs_ChunkCache, dirtyLink)->object;
 		if (obj)
 			yaffs_FlushFilesChunkCache(obj);
 
@@ -3965,13 +4195,14 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
  */
 static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 {
-	int i;
+	yaffs_ChunkCache *cache;
 
 	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
+		/* Free entries are kept at the front of the LRU */
+		cache = ylist_entry(dev->srCacheLru.next,
+				yaffs_ChunkCache, lruLink);
+		if (!cache->object)
+			return cache;
 	}
 
 	return NULL;
@@ -3980,44 +4211,37 @@ static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
 static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 {
 	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
+	yaffs_ChunkCache *dirtyCache;
+	struct ylist_head *i;
 
 	if (dev->nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
-
 		cache = yaffs_GrabChunkCacheWorker(dev);
 
 		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
+			/* Walk the LRU for the oldest clean entry, remembering
+			 * the oldest dirty one in case they are all dirty.
+			 * With locking we can't assume we can use any entry.
 			 */
+			dirtyCache = NULL;
 
-			/* With locking we can't assume we can use entry zero */
-
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
-
-			for (i = 0; i < dev->nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
+			ylist_for_each(i, &dev->srCacheLru) {
+				cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+				if (cache->locked)
+					continue;
+				if (!cache->dirty) {
+					yaffs_FreeChunkCache(dev, cache);
+					return cache;
 				}
+				if (!dirtyCache)
+					dirtyCache = cache;
 			}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
+			cache = NULL;
+			if (dirtyCache) {
+				/* Flush the whole object, so its dirty chunks
+				 * are written back together, then find again.
+				 */
+				yaffs_FlushFilesChunkCache(dirtyCache->object);
 				cache = yaffs_GrabChunkCacheWorker(dev);
 			}
 
@@ -4028,46 +4252,53 @@ static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
 
 }
 
-/* Find a cached chunk */
-static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
-					      int chunkId)
+static yaffs_ChunkCache *yaffs_LookupChunkCache(const yaffs_Object *obj,
+						int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
-	if (dev->nShortOpCaches > 0) {
-		for (i = 0; i < dev->nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
-				dev->cacheHits++;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
 
-				return &dev->srCache[i];
-			}
+	if (dev->nShortOpCaches > 0) {
+		ylist_for_each(i,
+			&dev->srCacheHash[yaffs_CacheHash(obj, chunkId)]) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId)
+				return cache;
 		}
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Find a cached chunk */
+static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
+					      int chunkId)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_ChunkCache *cache = yaffs_LookupChunkCache(obj, chunkId);
+
+	if (cache)
+		dev->cacheHits++;
+	else if (dev->nShortOpCaches > 0)
+		dev->cacheMisses++;
+
+	return cache;
+}
+
+/* Mark the chunk as the most recently used */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
 
 	if (dev->nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
+		ylist_del(&cache->lruLink);
+		ylist_add_tail(&cache->lruLink, &dev->srCacheLru);
 
-			dev->srLastUse = 0;
+		if (isAWrite) {
+			yaffs_SetChunkCacheDirty(dev, cache, 1);
+			dev->cacheWrites++;
 		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
-
-		if (isAWrite)
-			cache->dirty = 1;
 	}
 }
 
@@ -4078,10 +4309,10 @@ static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 {
 	if (object->myDev->nShortOpCaches > 0) {
-		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
+		yaffs_ChunkCache *cache = yaffs_LookupChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_FreeChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4097,7 +4328,7 @@ static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 		/* Invalidate it. */
 		for (i = 0; i < dev->nShortOpCaches; i++) {
 			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+				yaffs_FreeChunkCache(dev, &dev->srCache[i]);
 		}
 	}
 }
@@ -4172,6 +4403,7 @@ static int yaffs_WriteCheckpointDevice(yaffs_Device *dev)
 	yaffs_CheckpointDevice cp;
 	__u32 nBytes;
 	__u32 nBlocks = (dev->internalEndBlock - dev->internalStartBlock + 1);
+	int i;
 
 	int ok;
 
@@ -4187,10 +4419,17 @@ static int yaffs_WriteCheckpointDevice(yaffs_Device *dev)
 		ok = (yaffs_CheckpointWrite(dev, dev->blockInfo, nBytes) == nBytes);
 	}
 
-	/* Write chunk bits */
-	if (ok) {
-		nBytes = nBlocks * dev->chunkBitmapStride;
-		ok = (yaffs_CheckpointWrite(dev, dev->chunkBits, nBytes) == nBytes);
+	/* Write chunk bits, only for the blocks where the block info does not
+	 * already tell us that none or all of the chunks are in use.
+	 */
+	for (i = dev->internalStartBlock; ok && i <= dev->internalEndBlock; i++) {
+		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, i);
+
+		if (bi->pagesInUse > 0 && bi->pagesInUse < dev->nChunksPerBlock) {
+			nBytes = dev->chunkBitmapStride;
+			ok = (yaffs_CheckpointWrite(dev, yaffs_BlockBits(dev, i),
+						nBytes) == nBytes);
+		}
 	}
 	return	 ok ? 1 : 0;
 
@@ -4201,6 +4440,8 @@ static int yaffs_ReadCheckpointDevice(yaffs_Device *dev)
 	yaffs_CheckpointDevice cp;
 	__u32 nBytes;
 	__u32 nBlocks = (dev->internalEndBlock - dev->internalStartBlock + 1);
+	int i;
+	int c;
 
 	int ok;
 
@@ -4220,9 +4461,21 @@ static int yaffs_ReadCheckpointDevice(yaffs_Device *dev)
 
 	if (!ok)
 		return 0;
-	nBytes = nBlocks * dev->chunkBitmapStride;
 
-	ok = (yaffs_CheckpointRead(dev, dev->chunkBits, nBytes) == nBytes);
+	for (i = dev->internalStartBlock; ok && i <= dev->internalEndBlock; i++) {
+		yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, i);
+
+		yaffs_ClearChunkBits(dev, i);
+
+		if (bi->pagesInUse >= dev->nChunksPerBlock) {
+			for (c = 0; c < dev->nChunksPerBlock; c++)
+				yaffs_SetChunkBit(dev, i, c);
+		} else if (bi->pagesInUse > 0) {
+			nBytes = dev->chunkBitmapStride;
+			ok = (yaffs_CheckpointRead(dev, yaffs_BlockBits(dev, i),
+						nBytes) == nBytes);
+		}
+	}
 
 	return ok ? 1 : 0;
 }
@@ -4333,9 +4586,28 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 			}
 		} else if (level == 0) {
 			__u32 baseOffset = chunkOffset <<  YAFFS_TNODES_LEVEL0_BITS;
-			ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
-			if (ok)
-				ok = (yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+			__u32 firstChunk = yaffs_GetChunkGroupBase(dev, tn, 0);
+
+			/* A file written out sequentially mostly has tnodes
+			 * pointing at consecutive chunks. Those are stored as
+			 * the first chunk alone.
+			 */
+			for (i = 1; firstChunk && i < YAFFS_NTNODES_LEVEL0; i++) {
+				if (yaffs_GetChunkGroupBase(dev, tn, i) !=
+				    firstChunk + (i << dev->chunkGroupBits))
+					break;
+			}
+
+			if (firstChunk && i == YAFFS_NTNODES_LEVEL0) {
+				baseOffset |= YAFFS_CHECKPOINT_TNODE_RUN;
+				ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
+				if (ok)
+					ok = (yaffs_CheckpointWrite(dev, &firstChunk, sizeof(firstChunk)) == sizeof(firstChunk));
+			} else {
+				ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
+				if (ok)
+					ok = (yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+			}
 		}
 	}
 
@@ -4364,11 +4636,13 @@ static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
 static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 {
 	__u32 baseChunk;
+	__u32 firstChunk;
 	int ok = 1;
 	yaffs_Device *dev = obj->myDev;
 	yaffs_FileStructure *fileStructPtr = &obj->variant.fileVariant;
 	yaffs_Tnode *tn;
 	int nread = 0;
+	int i;
 	int tnodeSize = (dev->tnodeWidth * YAFFS_NTNODES_LEVEL0)/8;
 
 	if (tnodeSize < sizeof(yaffs_Tnode))
@@ -4382,10 +4656,17 @@ static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 
 
 		tn = yaffs_GetTnodeRaw(dev);
-		if (tn)
-			ok = (yaffs_CheckpointRead(dev, tn, tnodeSize) == tnodeSize);
-		else
+		if (!tn)
 			ok = 0;
+		else if (baseChunk & YAFFS_CHECKPOINT_TNODE_RUN) {
+			baseChunk &= ~YAFFS_CHECKPOINT_TNODE_RUN;
+			ok = (yaffs_CheckpointRead(dev, &firstChunk, sizeof(firstChunk)) == sizeof(firstChunk));
+			memset(tn, 0, tnodeSize);
+			for (i = 0; ok && i < YAFFS_NTNODES_LEVEL0; i++)
+				yaffs_PutLevel0Tnode(dev, tn, i,
+					firstChunk + (i << dev->chunkGroupBits));
+		} else
+			ok = (yaffs_CheckpointRead(dev, tn, tnodeSize) == tnodeSize);
 
 		if (tn && ok)
 			ok = yaffs_AddOrFindLevel0Tnode(dev,
@@ -4678,9 +4959,58 @@ int yaffs_CheckpointRestore(yaffs_Device *dev)
  * Curve-balls: the first chunk might also be the last chunk.
  */
 
+/* Read a whole chunk, looking the level 0 tnode up through the cursor. */
+static int yaffs_ReadChunkDataFromObjectCursor(yaffs_Object *in,
+					int chunkInInode, __u8 *buffer,
+					yaffs_ReadCursor *cursor)
+{
+	yaffs_Device *dev = in->myDev;
+	__u32 tnIndex = ((__u32)chunkInInode) >> YAFFS_TNODES_LEVEL0_BITS;
+	yaffs_Tnode *tn;
+	yaffs_ExtendedTags tags;
+	int chunkInNAND = -1;
+
+	if (cursor->obj == in && cursor->tn && cursor->tnIndex == tnIndex &&
+	    cursor->freeSeq == dev->tnodeFreeSeq)
+		tn = cursor->tn;
+	else {
+		tn = yaffs_FindLevel0Tnode(dev, &in->variant.fileVariant,
+					chunkInInode);
+		cursor->obj = in;
+		cursor->tn = tn;
+		cursor->tnIndex = tnIndex;
+		cursor->freeSeq = dev->tnodeFreeSeq;
+	}
+
+	if (tn)
+		chunkInNAND = yaffs_FindChunkInGroup(dev,
+				yaffs_GetChunkGroupBase(dev, tn, chunkInInode),
+				&tags, in->objectId, chunkInInode);
+
+	if (chunkInNAND >= 0)
+		return yaffs_ReadChunkWithTagsFromNAND(dev, chunkInNAND,
+						buffer, NULL);
+
+	/* get sane (zero) data if you read a hole */
+	memset(buffer, 0, dev->nDataBytesPerChunk);
+	return 0;
+}
+
 int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 			int nBytes)
 {
+	yaffs_ReadCursor cursor;
+
+	memset(&cursor, 0, sizeof(cursor));
+
+	return yaffs_ReadDataFromFileCursor(in, buffer, offset, nBytes,
+					&cursor);
+}
+
+int yaffs_ReadDataFromFileCursor(yaffs_Object *in, __u8 *buffer,
+				loff_t offset, int nBytes,
+				yaffs_ReadCursor *cursor)
+{
 
 	int chunk;
 	__u32 start;
@@ -4719,11 +5049,13 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
+					/* Grabbing may write back a dirty
+					 * chunk, which can change the tree.
+					 */
+					cursor->tn = NULL;
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AssignChunkCache(dev, cache,
+							in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
@@ -4756,7 +5088,8 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 		} else {
 
 			/* A full chunk. Read directly into the supplied buffer. */
-			yaffs_ReadChunkDataFromObject(in, chunk, buffer);
+			yaffs_ReadChunkDataFromObjectCursor(in, chunk, buffer,
+							cursor);
 
 		}
 
@@ -4850,10 +5183,8 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 				    && yaffs_CheckSpaceForAllocation(in->
 								     myDev)) {
 					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					yaffs_AssignChunkCache(dev, cache,
+							in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
@@ -4885,7 +5216,9 @@ int yaffs_WriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						dev->cacheWriteBacks++;
+						yaffs_SetChunkCacheDirty(dev,
+								cache, 0);
 					}
 
 				} else {
@@ -5434,6 +5767,72 @@ static int ybicmp(const void *a, const void *b)
 		return aseq - bseq;
 }
 
+/* Sort the block index by sequence number with a byte at a time radix
+ * sort. The index is built in block order and each pass is stable, so
+ * this gives the same order as ybicmp() in linear time. Bytes that are
+ * the same in every entry (the top ones, usually) are skipped.
+ */
+static void yaffs_SortBlockIndex(yaffs_BlockIndex *blockIndex, int n)
+{
+	yaffs_BlockIndex *tmp;
+	yaffs_BlockIndex *from;
+	yaffs_BlockIndex *to;
+	yaffs_BlockIndex *swap;
+	int count[256];
+	int altTmp = 0;
+	int shift;
+	int sum;
+	int i;
+	int t;
+
+	if (n < 2)
+		return;
+
+	tmp = YMALLOC(n * sizeof(yaffs_BlockIndex));
+	if (!tmp) {
+		tmp = YMALLOC_ALT(n * sizeof(yaffs_BlockIndex));
+		altTmp = 1;
+	}
+
+	if (!tmp) {
+		yaffs_qsort(blockIndex, n, sizeof(yaffs_BlockIndex), ybicmp);
+		return;
+	}
+
+	from = blockIndex;
+	to = tmp;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		memset(count, 0, sizeof(count));
+		for (i = 0; i < n; i++)
+			count[(((__u32)from[i].seq) >> shift) & 0xff]++;
+
+		if (count[(((__u32)from[0].seq) >> shift) & 0xff] == n)
+			continue;
+
+		for (i = 0, sum = 0; i < 256; i++) {
+			t = count[i];
+			count[i] = sum;
+			sum += t;
+		}
+
+		for (i = 0; i < n; i++)
+			to[count[(((__u32)from[i].seq) >> shift) & 0xff]++] = from[i];
+
+		swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != blockIndex)
+		memcpy(blockIndex, from, n * sizeof(yaffs_BlockIndex));
+
+	if (altTmp)
+		YFREE_ALT(tmp);
+	else
+		YFREE(tmp);
+}
+
 
 struct yaffs_ShadowFixerStruct {
 	int objectId;
@@ -6114,6 +6513,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	int foundChunksInBlock;
 	int equivalentObjectId;
 	int alloc_failed = 0;
+	yaffs_ExtendedTags *blockTags;
 
 
 	yaffs_BlockIndex *blockIndex = NULL;
@@ -6216,10 +6616,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 	/* Sort the blocks */
 #ifndef CONFIG_YAFFS_USE_OWN_SORT
-	{
-		/* Use qsort now. */
-		yaffs_qsort(blockIndex, nBlocksToScan, sizeof(yaffs_BlockIndex), ybicmp);
-	}
+	yaffs_SortBlockIndex(blockIndex, nBlocksToScan);
 #else
 	{
 		/* Dungy old bubble sort... */
@@ -6248,6 +6645,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	T(YAFFS_TRACE_SCAN_DEBUG,
 	  (TSTR("%d blocks to be scanned" TENDSTR), nBlocksToScan));
 
+	/* Tags are read a block at a time if we can get the memory */
+	blockTags = YMALLOC(dev->nChunksPerBlock * sizeof(yaffs_ExtendedTags));
+
 	/* For each block.... backwards */
 	for (blockIterator = endIterator; !alloc_failed && blockIterator >= startIterator;
 			blockIterator--) {
@@ -6265,6 +6665,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		if (blockTags &&
+		    (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING ||
+		     state == YAFFS_BLOCK_STATE_ALLOCATING))
+			result = yaffs_ReadBlockTagsFromNAND(dev, blk, blockTags);
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->nChunksPerBlock - 1;
@@ -6277,8 +6682,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (blockTags)
+				tags = blockTags[c];
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk,
+							NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6732,6 +7140,9 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	else
 		YFREE(blockIndex);
 
+	if (blockTags)
+		YFREE(blockTags);
+
 	/* Ok, we've done all the scanning.
 	 * Fix up the hard link chains.
 	 * We should now have scanned all the objects, now it's time to add these
@@ -7290,6 +7701,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 {
 	int init_failed = 0;
 	unsigned x;
+	int i;
 	int bits;
 
 	T(YAFFS_TRACE_TRACING, (TSTR("yaffs: yaffs_GutsInitialise()" TENDSTR)));
@@ -7438,7 +7850,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	/* More device initialisation */
 	dev->garbageCollections = 0;
 	dev->passiveGarbageCollections = 0;
-	dev->currentDirtyChecker = 0;
+	dev->backgroundGarbageCollections = 0;
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -7458,18 +7870,25 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	dev->srCache = NULL;
+	dev->srCacheFlush = NULL;
 	dev->gcCleanupList = NULL;
 
+	for (i = 0; i < YAFFS_CACHE_HASH_SIZE; i++)
+		YINIT_LIST_HEAD(&dev->srCacheHash[i]);
+	YINIT_LIST_HEAD(&dev->srCacheLru);
+	YINIT_LIST_HEAD(&dev->srCacheDirty);
+	dev->nDirtyCaches = 0;
 
 	if (!init_failed &&
 	    dev->nShortOpCaches > 0) {
-		int i;
 		void *buf;
-		int srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
 
 		if (dev->nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
+		srCacheBytes = dev->nShortOpCaches * sizeof(yaffs_ChunkCache);
+
 		dev->srCache =  YMALLOC(srCacheBytes);
 
 		buf = (__u8 *) dev->srCache;
@@ -7479,17 +7898,26 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 
 		for (i = 0; i < dev->nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].dirtyLink);
+			ylist_add_tail(&dev->srCache[i].lruLink,
+					&dev->srCacheLru);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->totalBytesPerChunk);
 		}
+		if (buf) {
+			dev->srCacheFlush = YMALLOC(dev->nShortOpCaches *
+						sizeof(yaffs_ChunkCache *));
+			buf = dev->srCacheFlush;
+		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
+	dev->cacheMisses = 0;
+	dev->cacheWrites = 0;
+	dev->cacheWriteBacks = 0;
 
 	if (!init_failed) {
 		dev->gcCleanupList = YMALLOC(dev->nChunksPerBlock * sizeof(__u32));
@@ -7557,6 +7985,9 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			yaffs_EmptyLostAndFound(dev);
 	}
 
+	if (!init_failed)
+		yaffs_RebuildGcBins(dev);
+
 	if (init_failed) {
 		/* Clean up the mess */
 		T(YAFFS_TRACE_TRACING,
@@ -7609,6 +8040,11 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 			dev->srCache = NULL;
 		}
 
+		if (dev->srCacheFlush) {
+			YFREE(dev->srCacheFlush);
+			dev->srCacheFlush = NULL;
+		}
+
 		YFREE(dev->gcCleanupList);
 
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
@@ -7656,7 +8092,6 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int nFree;
 	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -7668,10 +8103,7 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	nDirtyCacheChunks = dev->nDirtyCaches;
 
 	nFree -= nDirtyCacheChunks;
 
@@ -63,7 +63,10 @@
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	3
+#define YAFFS_CHECKPOINT_VERSION 	4
+
+/* Flags a checkpointed level 0 tnode stored as its first chunk only */
+#define YAFFS_CHECKPOINT_TNODE_RUN	0x80000000
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -88,7 +91,10 @@
 
 /* */
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+#define YAFFS_MAX_SHORT_OP_CACHES	512
+
+/* Number of hash buckets used to find cached chunks. Must be a power of 2 */
+#define YAFFS_CACHE_HASH_SIZE		128
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
@@ -113,9 +119,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* In srCacheHash while object is set */
+	struct ylist_head lruLink;	/* In srCacheLru, free entries first */
+	struct ylist_head dirtyLink;	/* In srCacheDirty while dirty */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -496,6 +504,18 @@ typedef struct {
 	int count;
 } yaffs_ObjectBucket;
 
+/* A read cursor remembers the level 0 tnode found by the last lookup, so
+ * that a run of reads through a file walks the tnode tree once per tnode
+ * rather than once per chunk. It may be kept across drops of the gross
+ * lock: the tnode is looked up again once any tnode has been freed.
+ */
+typedef struct {
+	yaffs_Object *obj;
+	yaffs_Tnode *tn;
+	__u32 tnIndex;		/* chunkId >> YAFFS_TNODES_LEVEL0_BITS */
+	__u32 freeSeq;		/* dev->tnodeFreeSeq when tn was looked up */
+} yaffs_ReadCursor;
+
 
 /* yaffs_CheckpointObject holds the definition of an object as dumped
  * by checkpointing.
@@ -587,6 +607,10 @@ struct yaffs_DeviceStruct {
 	int (*readChunkWithTagsFromNAND) (struct yaffs_DeviceStruct *dev,
 					  int chunkInNAND, __u8 *data,
 					  yaffs_ExtendedTags *tags);
+	/* Optional: read the tags of every chunk in a block in one go */
+	int (*readBlockTagsFromNAND) (struct yaffs_DeviceStruct *dev,
+				      int blockInNAND,
+				      yaffs_ExtendedTags *tags);
 	int (*markNANDBlockBad) (struct yaffs_DeviceStruct *dev, int blockNo);
 	int (*queryNANDBlock) (struct yaffs_DeviceStruct *dev, int blockNo,
 			       yaffs_BlockState *state, __u32 *sequenceNumber);
@@ -645,6 +669,13 @@ struct yaffs_DeviceStruct {
 	void (*putSuperFunc) (struct super_block *sb);
         struct ylist_head searchContexts;
 
+	struct task_struct *gcThread;	/* Background garbage collector */
+	__u8 *writepagesBuffer;	/* Gathers pages for chunks bigger than a page */
+	struct semaphore writepagesLock;	/* Serialises writepagesBuffer */
+	unsigned long lastActive;	/* jiffies at the last gross lock */
+	int lockedPageWrites;	/* nPageWrites when the gross lock was taken */
+	int gcPending;		/* written to since the last idle gc pass */
+
 #endif
 
 	int isMounted;
@@ -694,6 +725,7 @@ struct yaffs_DeviceStruct {
 	int nTnodesCreated;
 	yaffs_Tnode *freeTnodes;
 	int nFreeTnodes;
+	__u32 tnodeFreeSeq;	/* Bumped on every free, for read cursors */
 	yaffs_TnodeList *allocatedTnodeList;
 
 	int isDoingGC;
@@ -712,7 +744,14 @@ struct yaffs_DeviceStruct {
 
 	int nFreeChunks;
 
-	int currentDirtyChecker;	/* Used to find current dirtiest block */
+	/* GC candidates are binned by the number of live chunks in the
+	 * block so that the dirtiest one can be found without a scan.
+	 */
+	int *gcBinHead;		/* nChunksPerBlock + 1 list heads */
+	int *gcBinNext;		/* Per block links, -1 terminated */
+	int *gcBinPrev;
+	int *gcBinOf;		/* Per block bin, -1 if not binned */
+	int gcBinsAlt;
 
 	__u32 *gcCleanupList;	/* objects to delete at the end of a GC. */
 	int nonAggressiveSkip;	/* GC state/mode */
@@ -725,6 +764,7 @@ struct yaffs_DeviceStruct {
 	int nGCCopies;
 	int garbageCollections;
 	int passiveGarbageCollections;
+	int backgroundGarbageCollections;
 	int nRetriedWrites;
 	int nRetiredBlocks;
 	int eccFixed;
@@ -749,9 +789,16 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head srCacheHash[YAFFS_CACHE_HASH_SIZE];
+	struct ylist_head srCacheLru;	/* Least recently used first */
+	struct ylist_head srCacheDirty;
+	yaffs_ChunkCache **srCacheFlush;	/* Scratch for sorting a flush */
+	int nDirtyCaches;
 
 	int cacheHits;
+	int cacheMisses;
+	int cacheWrites;	/* Short writes absorbed by the cache */
+	int cacheWriteBacks;	/* Cached chunks written to NAND */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -842,6 +889,9 @@ int yaffs_GetAttributes(yaffs_Object *obj, struct iattr *attr);
 /* File operations */
 int yaffs_ReadDataFromFile(yaffs_Object *obj, __u8 *buffer, loff_t offset,
 				int nBytes);
+int yaffs_ReadDataFromFileCursor(yaffs_Object *obj, __u8 *buffer,
+				loff_t offset, int nBytes,
+				yaffs_ReadCursor *cursor);
 int yaffs_WriteDataToFile(yaffs_Object *obj, const __u8 *buffer, loff_t offset,
 				int nBytes, int writeThrough);
 int yaffs_ResizeFile(yaffs_Object *obj, loff_t newSize);
@@ -856,6 +906,9 @@ void yaffs_FlushEntireDeviceCache(yaffs_Device *dev);
 int yaffs_CheckpointSave(yaffs_Device *dev);
 int yaffs_CheckpointRestore(yaffs_Device *dev);
 
+/* Garbage collection */
+int yaffs_BackgroundGarbageCollect(yaffs_Device *dev);
+
 /* Directory operations */
 yaffs_Object *yaffs_MknodDirectory(yaffs_Object *parent, const YCHAR *name,
 				__u32 mode, __u32 uid, __u32 gid);
@@ -187,6 +187,62 @@ int nandmtd2_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 		return YAFFS_FAIL;
 }
 
+/* Fetch the oob of a whole block with one read_oob() call. The MTD layer
+ * packs the free oob bytes of consecutive pages back to back.
+ * Anything unexpected, including an ECC report we cannot attribute to a
+ * chunk, fails so that the caller falls back to reading chunk by chunk.
+ */
+int nandmtd2_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+				   yaffs_ExtendedTags *tags)
+{
+#if (MTD_VERSION_CODE > MTD_VERSION(2, 6, 17))
+	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
+	struct mtd_oob_ops ops;
+	yaffs_PackedTags2 pt;
+	__u8 *oob;
+	int oobPerChunk = mtd->oobavail;
+	int retval;
+	int i;
+
+	loff_t addr = ((loff_t) blockInNAND) * dev->nChunksPerBlock *
+			dev->totalBytesPerChunk;
+
+	T(YAFFS_TRACE_MTD,
+	  (TSTR("nandmtd2_ReadBlockTagsFromNAND block %d" TENDSTR),
+	   blockInNAND));
+
+	if (dev->inbandTags || oobPerChunk < sizeof(pt))
+		return YAFFS_FAIL;
+
+	oob = YMALLOC(dev->nChunksPerBlock * oobPerChunk);
+	if (!oob)
+		return YAFFS_FAIL;
+
+	ops.mode = MTD_OOB_AUTO;
+	ops.ooblen = dev->nChunksPerBlock * oobPerChunk;
+	ops.len = 0;
+	ops.ooboffs = 0;
+	ops.datbuf = NULL;
+	ops.oobbuf = oob;
+	ops.oobretlen = 0;
+	retval = mtd->read_oob(mtd, addr, &ops);
+
+	if (retval == 0 && ops.oobretlen == ops.ooblen) {
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			memcpy(&pt, oob + i * oobPerChunk, sizeof(pt));
+			yaffs_UnpackTags2(&tags[i], &pt);
+		}
+	}
+
+	YFREE(oob);
+
+	return (retval == 0 && ops.oobretlen == ops.ooblen) ?
+		YAFFS_OK : YAFFS_FAIL;
+#else
+	return YAFFS_FAIL;
+#endif
+}
+
 int nandmtd2_MarkNANDBlockBad(struct yaffs_DeviceStruct *dev, int blockNo)
 {
 	struct mtd_info *mtd = (struct mtd_info *)(dev->genericDevice);
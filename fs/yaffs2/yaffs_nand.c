@@ -53,6 +53,42 @@ int yaffs_ReadChunkWithTagsFromNAND(yaffs_Device *dev, int chunkInNAND,
 	return result;
 }
 
+/* Read the tags of all the chunks in a block into tags[], using the
+ * driver's block read if it has one, else a chunk at a time.
+ */
+int yaffs_ReadBlockTagsFromNAND(yaffs_Device *dev, int blockInNAND,
+					yaffs_ExtendedTags *tags)
+{
+	int result = YAFFS_FAIL;
+	int chunk = blockInNAND * dev->nChunksPerBlock;
+	int i;
+
+	if (dev->readBlockTagsFromNAND)
+		result = dev->readBlockTagsFromNAND(dev,
+					blockInNAND - dev->blockOffset, tags);
+
+	if (result == YAFFS_OK) {
+		dev->nPageReads += dev->nChunksPerBlock;
+
+		for (i = 0; i < dev->nChunksPerBlock; i++) {
+			if (tags[i].eccResult > YAFFS_ECC_RESULT_NO_ERROR) {
+				yaffs_HandleChunkError(dev,
+					yaffs_GetBlockInfo(dev, blockInNAND));
+			}
+		}
+		return YAFFS_OK;
+	}
+
+	result = YAFFS_OK;
+	for (i = 0; i < dev->nChunksPerBlock; i++) {
+		if (yaffs_ReadChunkWithTagsFromNAND(dev, chunk + i, NULL,
+						&tags[i]) != YAFFS_OK)
+			result = YAFFS_FAIL;
+	}
+
+	return result;
+}
+
 int yaffs_WriteChunkWithTagsToNAND(yaffs_Device *dev,
 						   int chunkInNAND,
 						   const __u8 *buffer,
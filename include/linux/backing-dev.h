@@ -26,6 +26,7 @@ enum bdi_state {
 	BDI_pdflush,		/* A pdflush thread is working this device */
 	BDI_write_congested,	/* The write queue is getting full */
 	BDI_read_congested,	/* The read queue is getting full */
+	BDI_writeback_held,	/* Periodic writeback leaves this device alone */
 	BDI_unused,		/* Available bits start here */
 };
 
@@ -223,6 +224,26 @@ static inline int bdi_write_congested(struct backing_dev_info *bdi)
 	return bdi_congested(bdi, 1 << BDI_write_congested);
 }
 
+/*
+ * A held device is skipped by pdflush without counting as congested, so
+ * the writeback loops don't poll it. sync, writers throttled at the dirty
+ * threshold and reclaim still write to it.
+ */
+static inline int bdi_writeback_held(struct backing_dev_info *bdi)
+{
+	return test_bit(BDI_writeback_held, &bdi->state);
+}
+
+static inline void bdi_hold_writeback(struct backing_dev_info *bdi)
+{
+	set_bit(BDI_writeback_held, &bdi->state);
+}
+
+static inline void bdi_release_writeback(struct backing_dev_info *bdi)
+{
+	clear_bit(BDI_writeback_held, &bdi->state);
+}
+
 static inline int bdi_rw_congested(struct backing_dev_info *bdi)
 {
 	return bdi_congested(bdi, (1 << BDI_read_congested)|
@@ -13,6 +13,7 @@
 
 struct zonelist;
 struct notifier_block;
+struct task_struct;
 
 /*
  * Types of limitations to the nodes from which allocations may occur
@@ -29,6 +30,17 @@ extern void clear_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
 extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask, int order);
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+
+/* events of the oom_adj notifier chain, the data is the task */
+enum oom_adj_event {
+	OOM_ADJ_CHANGED,	/* /proc/<pid>/oom_adj was written */
+	OOM_ADJ_FORK,		/* a new thread group was created */
+	OOM_ADJ_EXIT,		/* the last thread of the group exits */
+};
+
+extern void oom_adj_notify(struct task_struct *task, enum oom_adj_event event);
 
 #endif /* __KERNEL__*/
 #endif /* _INCLUDE_LINUX_OOM_H */
@@ -26,6 +26,7 @@
 #include <linux/pid_namespace.h>
 #include <linux/ptrace.h>
 #include <linux/profile.h>
+#include <linux/oom.h>
 #include <linux/mount.h>
 #include <linux/proc_fs.h>
 #include <linux/kthread.h>
@@ -1034,8 +1035,10 @@ NORET_TYPE void do_exit(long code)
 		exit_itimers(tsk->signal);
 	}
 	acct_collect(code, group_dead);
-	if (group_dead)
+	if (group_dead) {
 		tty_audit_exit();
+		oom_adj_notify(tsk, OOM_ADJ_EXIT);
+	}
 	if (unlikely(tsk->audit_context))
 		audit_free(tsk);
 
@@ -49,6 +49,7 @@
 #include <linux/memcontrol.h>
 #include <linux/ftrace.h>
 #include <linux/profile.h>
+#include <linux/oom.h>
 #include <linux/rmap.h>
 #include <linux/acct.h>
 #include <linux/tsacct_kern.h>
@@ -1278,6 +1279,8 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 	write_unlock_irq(&tasklist_lock);
 	proc_fork_connector(p);
 	cgroup_post_fork(p);
+	if (!(clone_flags & CLONE_THREAD))
+		oom_adj_notify(p, OOM_ADJ_FORK);
 	return p;
 
 bad_fork_free_graph:
@@ -13,10 +13,13 @@
  *
  */
 
+#include <linux/debugfs.h>
 #include <linux/earlysuspend.h>
+#include <linux/kthread.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
 #include <linux/rtc.h>
+#include <linux/seq_file.h>
 #include <linux/syscalls.h> /* sys_sync */
 #include <linux/wakelock.h>
 #include <linux/workqueue.h>
@@ -29,6 +32,11 @@ enum {
 };
 static int debug_mask = DEBUG_USER_STATE;
 module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
+/* off by default: handlers of a level ran in order until now, and some
+ * platforms depend on it. Turn on once the handlers have been audited. */
+static int parallel_handlers;
+module_param_named(parallel_handlers, parallel_handlers, int,
+		   S_IRUGO | S_IWUSR | S_IWGRP);
 
 static DEFINE_MUTEX(early_suspend_lock);
 static LIST_HEAD(early_suspend_handlers);
@@ -44,6 +52,87 @@ enum {
 };
 static int state;
 
+/*
+ * Handlers at the same level run concurrently, each but the last one in a
+ * short lived thread. kernel/async.c is not used since it only runs
+ * anything asynchronously when booted with "fastboot".
+ */
+static atomic_t handlers_pending = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(handlers_wait);
+
+static void call_handler(struct early_suspend *handler, int resume)
+{
+	ktime_t start = ktime_get();
+	ktime_t duration;
+
+	if (resume) {
+		handler->resume(handler);
+		duration = ktime_sub(ktime_get(), start);
+		handler->resume_time = duration;
+		if (ktime_to_ns(duration) >
+		    ktime_to_ns(handler->resume_max_time))
+			handler->resume_max_time = duration;
+	} else {
+		handler->suspend(handler);
+		duration = ktime_sub(ktime_get(), start);
+		handler->suspend_time = duration;
+		if (ktime_to_ns(duration) >
+		    ktime_to_ns(handler->suspend_max_time))
+			handler->suspend_max_time = duration;
+	}
+	if (debug_mask & DEBUG_SUSPEND)
+		pr_info("%s: %pF took %lld us\n",
+			resume ? "late_resume" : "early_suspend",
+			resume ? (void *)handler->resume :
+				 (void *)handler->suspend,
+			ktime_to_us(duration));
+}
+
+static int early_suspend_thread(void *data)
+{
+	call_handler(data, 0);
+	if (atomic_dec_and_test(&handlers_pending))
+		wake_up(&handlers_wait);
+	return 0;
+}
+
+static int late_resume_thread(void *data)
+{
+	call_handler(data, 1);
+	if (atomic_dec_and_test(&handlers_pending))
+		wake_up(&handlers_wait);
+	return 0;
+}
+
+static void run_handler(struct early_suspend *handler, int resume, int async)
+{
+	struct task_struct *task;
+
+	if (async) {
+		atomic_inc(&handlers_pending);
+		task = kthread_run(resume ? late_resume_thread :
+				   early_suspend_thread, handler,
+				   "early_suspend/%d", handler->level);
+		if (!IS_ERR(task))
+			return;
+		atomic_dec(&handlers_pending);
+	}
+	call_handler(handler, resume);
+}
+
+/* Is handler the last one of its level, looking towards next? */
+static int last_of_level(struct early_suspend *handler, struct list_head *next)
+{
+	return next == &early_suspend_handlers ||
+		list_entry(next, struct early_suspend, link)->level !=
+		handler->level;
+}
+
+static void wait_for_handlers(void)
+{
+	wait_event(handlers_wait, !atomic_read(&handlers_pending));
+}
+
 void register_early_suspend(struct early_suspend *handler)
 {
 	struct list_head *pos;
@@ -94,8 +183,11 @@ static void early_suspend(struct work_struct *work)
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("early_suspend: call handlers\n");
 	list_for_each_entry(pos, &early_suspend_handlers, link) {
+		int last = last_of_level(pos, pos->link.next);
 		if (pos->suspend != NULL)
-			pos->suspend(pos);
+			run_handler(pos, 0, parallel_handlers && !last);
+		if (last)
+			wait_for_handlers();
 	}
 	mutex_unlock(&early_suspend_lock);
 
@@ -131,9 +223,13 @@ static void late_resume(struct work_struct *work)
 	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: call handlers\n");
-	list_for_each_entry_reverse(pos, &early_suspend_handlers, link)
+	list_for_each_entry_reverse(pos, &early_suspend_handlers, link) {
+		int last = last_of_level(pos, pos->link.prev);
 		if (pos->resume != NULL)
-			pos->resume(pos);
+			run_handler(pos, 1, parallel_handlers && !last);
+		if (last)
+			wait_for_handlers();
+	}
 	if (debug_mask & DEBUG_SUSPEND)
 		pr_info("late_resume: done\n");
 abort:
@@ -176,3 +272,44 @@ suspend_state_t get_suspend_state(void)
 {
 	return requested_suspend_state;
 }
+
+#ifdef CONFIG_DEBUG_FS
+static int early_suspend_debug_show(struct seq_file *m, void *unused)
+{
+	struct early_suspend *pos;
+
+	seq_printf(m, "level  suspend_us  max_suspend_us  resume_us  "
+		   "max_resume_us  handler\n");
+	mutex_lock(&early_suspend_lock);
+	list_for_each_entry(pos, &early_suspend_handlers, link)
+		seq_printf(m, "%5d  %10lld  %14lld  %9lld  %13lld  %pF\n",
+			   pos->level, ktime_to_us(pos->suspend_time),
+			   ktime_to_us(pos->suspend_max_time),
+			   ktime_to_us(pos->resume_time),
+			   ktime_to_us(pos->resume_max_time),
+			   pos->suspend ? (void *)pos->suspend :
+					  (void *)pos->resume);
+	mutex_unlock(&early_suspend_lock);
+	return 0;
+}
+
+static int early_suspend_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, early_suspend_debug_show, NULL);
+}
+
+static const struct file_operations early_suspend_debug_fops = {
+	.open = early_suspend_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int __init early_suspend_debug_init(void)
+{
+	debugfs_create_file("early_suspend", S_IRUGO, NULL, NULL,
+			    &early_suspend_debug_fops);
+	return 0;
+}
+late_initcall(early_suspend_debug_init);
+#endif
@@ -19,12 +19,15 @@
 #include <linux/freezer.h>
 #include <linux/reboot.h>
 #include <linux/delay.h>
+#include <linux/backing-dev.h>
 
 #include <linux/semaphore.h>
 #include <asm/uaccess.h>
 
 #define DBG if(0)
 #define MAX_ENTRIES 32
+/* drivers without i/o events are looked at as often as before */
+#define HDD_DPM_POLL HZ
 
 #define PROC_READ_RETURN(page,start,off,count,eof,len) \
 {					\
@@ -39,17 +42,39 @@
 	return len;			\
 }
 
+/* thread_data flags */
+#define HDD_DPM_SPUN_DOWN	0	/* spun down by us, not spun up since */
+#define HDD_DPM_IDLE_WAIT	1	/* thread waits for the next i/o */
+#define HDD_DPM_KICK		2	/* thread has to recheck the drive */
+#define HDD_DPM_HELD		3	/* writeback held on this->bdi */
+
 struct thread_data {
 	struct task_struct* handle;
 	struct hdd_dpm_ops *dpm_ops;
 	unsigned long io_count;
 	int idle_timeout;
-	int timeout;
+	/* jiffies of the last i/o seen */
+	unsigned long last_io;
+	/* drivers that report i/o through hdd_dpm_io_event */
+	int io_events;
+	/* user asked for standby, spin down after min_idle */
+	int force_idle;
+	unsigned long flags;
 	int pm_request;
 	wait_queue_head_t wq;
 	struct proc_dir_entry* proc;
 	struct semaphore lock;
 	int last_pm_state;
+	/* hold back writeback while spun down, see hdd_dpm_spin_down */
+	int hold_writeback;
+	struct backing_dev_info *bdi;
+	/* statistics */
+	unsigned long spun_down_at;
+	unsigned long spun_down_time;
+	unsigned long spinups;
+	unsigned long flushes;
+	unsigned long flush_bytes;
+	unsigned long last_flush_bytes;
 };
 
 struct hdpwrd_proc_entry {
@@ -67,92 +92,189 @@ static inline unsigned long get_drive_io(struct hdd_dpm_ops *dpm_ops)
 	return dpm_ops->get_iocount(dpm_ops);
 }
 
+/* jiffies left until the drive has been idle for min_idle seconds */
+static long hdd_dpm_min_wait(struct thread_data *this)
+{
+	return (long)(this->last_io + this->dpm_ops->min_idle * HZ - jiffies);
+}
+
+static void hdd_dpm_release_writeback(struct thread_data *this)
+{
+	if (test_and_clear_bit(HDD_DPM_HELD, &this->flags))
+		bdi_release_writeback(this->bdi);
+}
+
+static void hdd_dpm_spun_up(struct thread_data *this)
+{
+	if (!test_and_clear_bit(HDD_DPM_SPUN_DOWN, &this->flags))
+		return;
+	this->spinups++;
+	this->spun_down_time += jiffies - this->spun_down_at;
+	hdd_dpm_release_writeback(this);
+}
+
+/*
+ * Flush the dirty data in one burst and spin the drive down. If enabled,
+ * writeback of the drive's queue is then held, which keeps pdflush away
+ * from it until the next i/o spins it up again. The queue is not marked
+ * congested, so pdflush does not poll it either. sync, writers throttled
+ * at the dirty threshold and reclaim still write to it. Caller holds
+ * this->lock.
+ */
+static int hdd_dpm_spin_down(struct thread_data *this)
+{
+	struct hdd_dpm_ops *dpm_ops = this->dpm_ops;
+	unsigned long dirty = 0;
+
+	this->bdi = NULL;
+	if (dpm_ops->get_bdi && this->hold_writeback)
+		this->bdi = dpm_ops->get_bdi(dpm_ops);
+	if (this->bdi)
+		dirty = bdi_stat(this->bdi, BDI_RECLAIMABLE);
+	if (dpm_ops->sync)
+		dpm_ops->sync(dpm_ops);
+	if (dirty) {
+		this->flushes++;
+		this->last_flush_bytes = dirty << PAGE_SHIFT;
+		this->flush_bytes += this->last_flush_bytes;
+	}
+
+	this->spun_down_at = jiffies;
+	set_bit(HDD_DPM_SPUN_DOWN, &this->flags);
+	if (this->bdi) {
+		set_bit(HDD_DPM_HELD, &this->flags);
+		bdi_hold_writeback(this->bdi);
+	}
+	if (unlikely(dpm_ops->suspend(dpm_ops) < 0)) {
+		hdd_dpm_release_writeback(this);
+		clear_bit(HDD_DPM_SPUN_DOWN, &this->flags);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Called by the driver when a command completed. Only records the time,
+ * the thread is woken up only if it has nothing to wait for.
+ */
+void hdd_dpm_io_event(struct hdd_dpm_ops *dpm_ops)
+{
+	struct thread_data *this = dpm_ops->dpm_data;
+
+	if (this == NULL)
+		return;
+	this->io_events = 1;
+	this->last_io = jiffies;
+	this->force_idle = 0;
+	hdd_dpm_spun_up(this);
+	if (test_and_clear_bit(HDD_DPM_IDLE_WAIT, &this->flags)) {
+		set_bit(HDD_DPM_KICK, &this->flags);
+		wake_up_interruptible(&this->wq);
+	}
+}
+
+/* returns how long to wait before looking at the drive again */
+static long hdd_dpm_check(struct thread_data *this)
+{
+	struct hdd_dpm_ops *dpm_ops = this->dpm_ops;
+	unsigned long new_stats;
+	unsigned long idle;
+	long wait_time;
+	long poll;
+
+	/* from here on, an i/o event kicks the thread */
+	set_bit(HDD_DPM_IDLE_WAIT, &this->flags);
+
+	/* without i/o events, a spin up is only seen by looking */
+	poll = MAX_SCHEDULE_TIMEOUT;
+	if (!this->io_events) {
+		poll = HDD_DPM_POLL;
+		down(&this->lock);
+		if (dpm_ops->pm_state == PM_SUSPEND_ON)
+			hdd_dpm_spun_up(this);
+		up(&this->lock);
+	}
+
+	// no timeout at all, leave it spinning
+	if (this->idle_timeout == 0 && !this->force_idle)
+		return poll;
+	// spun down, the next i/o spins it up and kicks us
+	if (dpm_ops->pm_state != PM_SUSPEND_ON && dpm_ops->pm_state != -1)
+		return poll;
+
+	new_stats = get_drive_io(dpm_ops);
+
+	down(&this->lock);
+	if (!new_stats || new_stats != this->io_count) {
+DBG		printk(KERN_DEBUG "hdpwrd: new_stats: %ld old_stats: %ld\n",
+			new_stats, this->io_count);
+		/* a request is pending, or a driver without i/o events did
+		 * some i/o since the last check */
+		if (!new_stats || !this->io_events) {
+			this->last_io = jiffies;
+			this->force_idle = 0;
+		}
+		this->io_count = new_stats;
+	}
+
+	idle = this->force_idle ? dpm_ops->min_idle : this->idle_timeout;
+	wait_time = (long)(this->last_io + idle * HZ - jiffies);
+	if (dpm_ops->pm_state == PM_SUSPEND_ON && wait_time <= 0) {
+		if (hdd_dpm_spin_down(this) < 0) {
+DBG			printk(KERN_DEBUG "hdpwrd: suspending drive failed\n");
+			/* retry after one second */
+			wait_time = HZ;
+		} else {
+DBG			printk(KERN_DEBUG "hdpwrd: suspending drive on timeout\n");
+			this->force_idle = 0;
+			wait_time = poll;
+		}
+	} else if (wait_time <= 0)
+		wait_time = HZ;
+	up(&this->lock);
+
+	if (wait_time != MAX_SCHEDULE_TIMEOUT)
+		clear_bit(HDD_DPM_IDLE_WAIT, &this->flags);
+	return wait_time;
+}
+
 static int pwr_check_thread(void* data)
 {
 	struct thread_data *this = data;
-	long wait_time = HZ;
+	long wait_time = 0;
 
 	set_freezable();
 	
 	do {
-		unsigned long new_stats;
-
 		this->pm_request = -1;
-		wait_time = wait_event_freezable_timeout(this->wq, this->pm_request != -1, wait_time);
-
-		// if signalled but not requested to stop, ignore the signal
-		if (wait_time < 0) {
-			wait_time = HZ;
-			continue;
-		}
+		wait_event_freezable_timeout(this->wq,
+			this->pm_request != -1 ||
+			test_bit(HDD_DPM_KICK, &this->flags) ||
+			kthread_should_stop(), wait_time);
+		clear_bit(HDD_DPM_KICK, &this->flags);
+		if (kthread_should_stop())
+			break;
 
 		// woken up by a request
 		if (this->pm_request != -1) {
 			struct hdd_dpm_ops *dpm_ops = this->dpm_ops;
-			int min_wait;
 			
 			if (dpm_ops->pm_state != -1 && this->pm_request != dpm_ops->pm_state) {
 				if (this->pm_request == PM_SUSPEND_ON) {
 DBG					printk(KERN_DEBUG "hdpwrd: resuming drive on user request\n");
 					dpm_ops->resume(dpm_ops);
-					this->timeout = this->idle_timeout;
-					wait_time = HZ;
+					this->last_io = jiffies;
+					hdd_dpm_spun_up(this);
 				} else {
 DBG					printk(KERN_DEBUG "hdpwrd: suspending drive on user request\n");
-					min_wait = dpm_ops->min_idle-(this->idle_timeout-this->timeout);
-					if (min_wait < 0)
-						this->timeout = 0;
-					else
-						this->timeout = min_wait;
-					wait_time = 0;
-DBG					printk(KERN_DEBUG "hdpwrd: min_wait %i\n", min_wait);
+					this->force_idle = 1;
+DBG					printk(KERN_DEBUG "hdpwrd: min_wait %li\n", hdd_dpm_min_wait(this));
 				}
 				this->pm_request = -1;
 			}
 		}
 
-		// not yet done waiting
-		if (wait_time)
-			continue;
-
-		wait_time = HZ;
-
-		// no timeout at all, leave it spinning
-		if (this->idle_timeout == 0)
-			continue;
-
-		// timed out, run state machine
-		new_stats = get_drive_io(this->dpm_ops);
-		
-		down(&this->lock);
-		if (!new_stats || new_stats != this->io_count) {
-			/* renew the timeout */
-DBG			printk(KERN_DEBUG "hdpwrd: new_stats: %ld old_stats: %ld\n", 
-				new_stats, this->io_count);
-			this->io_count = new_stats;
-			this->timeout = this->idle_timeout;
-		} else {
-			struct hdd_dpm_ops *dpm_ops = this->dpm_ops;
-			if (dpm_ops->pm_state == PM_SUSPEND_ON) {
-DBG				printk(KERN_DEBUG "hdpwrd: timeout left %i\n", this->timeout);
-				if (this->timeout == 0) {
-					if (dpm_ops->sync)
-						dpm_ops->sync(dpm_ops);
-					if (unlikely(dpm_ops->suspend(dpm_ops)) < 0) {
-DBG						printk(KERN_DEBUG "hdpwrd: suspending drive failed\n");
-						/* retry after one second */
-					} else {
-DBG						printk(KERN_DEBUG "hdpwrd: suspending drive on timeout\n");
-						this->timeout = this->idle_timeout;
-					}
-				} else
-				if (this->timeout > 0) {
-					this->timeout--;
-				}
-			} 
-		}
-		up(&this->lock);
-
+		wait_time = hdd_dpm_check(this);
 	} while (!kthread_should_stop());
 
 	return 0;
@@ -176,6 +298,56 @@ static int proc_hdpwrd_read_state(char *page, char **start, off_t off, int count
 	PROC_READ_RETURN(page,start,off,count,eof,len);
 }
 
+static int proc_hdpwrd_read_stats(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct thread_data *this = data;
+	unsigned long spun_down_time;
+	int len;
+
+	spun_down_time = this->spun_down_time;
+	if (test_bit(HDD_DPM_SPUN_DOWN, &this->flags))
+		spun_down_time += jiffies - this->spun_down_at;
+
+	len = sprintf(page, "spinups: %lu\n"
+		      "spun_down_ms: %u\n"
+		      "flushes: %lu\n"
+		      "last_flush_bytes: %lu\n"
+		      "avg_flush_bytes: %lu\n",
+		      this->spinups, jiffies_to_msecs(spun_down_time),
+		      this->flushes, this->last_flush_bytes,
+		      this->flushes ? this->flush_bytes / this->flushes : 0);
+	PROC_READ_RETURN(page,start,off,count,eof,len);
+}
+
+static int proc_hdpwrd_read_hold_writeback(char *page, char **start, off_t off, int count, int *eof, void *data)
+{
+	struct thread_data *this = data;
+	int len;
+
+	len = sprintf(page, "%i\n", this->hold_writeback);
+	PROC_READ_RETURN(page,start,off,count,eof,len);
+}
+
+static int proc_hdpwrd_write_hold_writeback(struct file *file, const char __user *buffer, unsigned long count, void *data)
+{
+	struct thread_data* this = data;
+	char buf[16];
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EACCES;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+
+	if (copy_from_user(buf, buffer, count))
+		return -EFAULT;
+
+	buf[count] = '\0';
+	this->hold_writeback = simple_strtol(buf, NULL, 10) != 0;
+
+	return count;
+}
+
 static int proc_hdpwrd_write_timeout(struct file *file, const char __user *buffer, unsigned long count, void *data)
 {
 	struct thread_data* this = data;
@@ -212,6 +384,9 @@ static int proc_hdpwrd_write_timeout(struct file *file, const char __user *buffe
 	if (idle_timeout < this->dpm_ops->min_idle)
 		idle_timeout = this->dpm_ops->min_idle;
 	this->idle_timeout = idle_timeout;
+	/* let the thread recompute its deadline */
+	set_bit(HDD_DPM_KICK, &this->flags);
+	wake_up_interruptible(&this->wq);
 	
 DBG	printk(KERN_DEBUG "hdpwrd: new idle_timeout %i\n", this->idle_timeout);
 	
@@ -263,7 +438,6 @@ static int proc_hdpwrd_write_state(struct file *file, const char __user *buffer,
 	switch (pm_state) {
 	case PM_SUSPEND_ON:
 		if (dpm_ops->pm_state != pm_state) {
-			this->timeout = this->idle_timeout;
 			this->pm_request = pm_state;
 			wake_up_interruptible(&this->wq);			
 		}
@@ -285,6 +459,8 @@ static int proc_hdpwrd_write_state(struct file *file, const char __user *buffer,
 struct hdpwrd_proc_entry drive_proc_entries[] = {
 	{ "timeout", S_IFREG|S_IRUGO, proc_hdpwrd_read_timeout, proc_hdpwrd_write_timeout },
 	{ "state",   S_IFREG|S_IRUGO|S_IWUSR, proc_hdpwrd_read_state,   proc_hdpwrd_write_state },
+	{ "stats",   S_IFREG|S_IRUGO, proc_hdpwrd_read_stats,   NULL },
+	{ "hold_writeback", S_IFREG|S_IRUGO|S_IWUSR, proc_hdpwrd_read_hold_writeback, proc_hdpwrd_write_hold_writeback },
 };
 
 static struct proc_dir_entry *create_drive_entry(struct thread_data *this, struct proc_dir_entry* parent)
@@ -390,17 +566,20 @@ DBG	printk(KERN_DEBUG "hdd_dpm_register_dev (%s)\n", dpm_ops->name);
 		td->idle_timeout = dpm_ops->min_idle; 
 
 	td->dpm_ops       = dpm_ops;
-	td->timeout       = td->idle_timeout;
+	td->last_io       = jiffies;
 	td->io_count      = 0;
 	td->last_pm_state = -1;
+	td->hold_writeback = 1;
 	td->proc          = create_drive_entry(td, proc_hdpwrd_root);
 
 	init_waitqueue_head(&td->wq);
 	init_MUTEX(&td->lock);
+	dpm_ops->dpm_data = td;
 
 	td->handle = kthread_run(pwr_check_thread, td, "hdd-dpm/%s", dpm_ops->name);
 	if (IS_ERR(td->handle)) {
 		int ret = PTR_ERR(td->handle);
+		dpm_ops->dpm_data = NULL;
 		hdd_dpm_removetd(td);
 		kfree(td);
 		return ret;
@@ -420,6 +599,8 @@ DBG	printk(KERN_DEBUG "hdd_dpm_unregister_dev (%s)\n", dpm_ops->name);
 		return -ENODEV;
 
 	kthread_stop(td->handle);
+	dpm_ops->dpm_data = NULL;
+	hdd_dpm_spun_up(td);
 
 	for (n = 0; n < ARRAY_SIZE(drive_proc_entries); n++) {
 		remove_proc_entry(drive_proc_entries[n].name, td->proc);
@@ -447,11 +628,11 @@ static int hdd_dpm_reboot(struct notifier_block *notifier, unsigned long val,
 		this = thread_instance[n];         
 		dpm_ops = this->dpm_ops;
 		if (dpm_ops->shutdown && dpm_ops->pm_state == PM_SUSPEND_ON) {
-			int min_wait;
+			long min_wait;
 			
-			min_wait = dpm_ops->min_idle-(this->idle_timeout-this->timeout);
+			min_wait = hdd_dpm_min_wait(this);
 			if (min_wait > 0)
-				msleep(min_wait*HZ);
+				msleep(jiffies_to_msecs(min_wait));
 			if (dpm_ops->sync)
 				dpm_ops->sync(dpm_ops);
 			dpm_ops->suspend(dpm_ops);
@@ -495,15 +676,13 @@ static int hdd_dpm_notify_suspend(struct notifier_block *notifier,
 			down(&this->lock);
 			dpm_ops = this->dpm_ops;
 			if (dpm_ops->pm_state == PM_SUSPEND_ON) {
-				int min_wait;
+				long min_wait;
 				
-				min_wait = dpm_ops->min_idle-(this->idle_timeout-this->timeout);
+				min_wait = hdd_dpm_min_wait(this);
 				if (min_wait > 0)
-					msleep(min_wait*HZ);
-				if (dpm_ops->sync)
-					dpm_ops->sync(dpm_ops);
+					msleep(jiffies_to_msecs(min_wait));
 				dpm_ops->suspend_locked = 1;
-				dpm_ops->suspend(dpm_ops);
+				hdd_dpm_spin_down(this);
 			} else {
 				dpm_ops->suspend_locked = 1;
 			}
@@ -555,3 +734,4 @@ subsys_initcall(hdd_dpm_init);
 
 EXPORT_SYMBOL(hdd_dpm_register_dev);
 EXPORT_SYMBOL(hdd_dpm_unregister_dev);
+EXPORT_SYMBOL(hdd_dpm_io_event);